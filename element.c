@@ -250,8 +250,8 @@ int get_video_info(ringbuffer *rbuf, sequence_t *s, long off, int le)
 	s->pulldown_set = 0;
         if ((re = ring_find_mpg_header(rbuf, SEQUENCE_HDR_CODE, off, le)) < 0)
 		return re;
-	headr = buf+4;
-	if (ring_peek(rbuf, buf, 150, off) < 0) return -2;
+	if (!(headr = ring_peek_ptr(rbuf, buf, 150, off))) return -2;
+	headr += 4;
 	
 	s->h_size	= ((headr[1] &0xF0) >> 4) | (headr[0] << 4);
 	s->v_size	= ((headr[1] &0x0F) << 8) | (headr[2]);
@@ -562,18 +562,14 @@ int check_audio_header(ringbuffer *rbuf, audio_frame_t * af, long  off, int le,
 }
 
 
-int get_audio_info(ringbuffer *rbuf, audio_frame_t *af, long off, int le, int verb) 
+// reads the MPEG audio header in headr
+int audio_header_info(uint8_t *headr, audio_frame_t *af, int verb)
 {
-	int c = 0;
 	int fr =0;
-	uint8_t headr[4];
         int sample_rate_index;
 
 	af->set=0;
 
-	if ( (c = find_audio_sync(rbuf, headr, off, MPEG_AUDIO,le)) < 0 ) 
-		return c;
-
         af->layer = 4 - ((headr[1] & 0x06) >> 1);
 //        if (af->layer >3) return -1;
 
@@ -621,30 +617,36 @@ int get_audio_info(ringbuffer *rbuf, audio_frame_t *af, long off, int le, int ve
 			fprintf (stderr,"  Freq: %2.1f kHz", 
 				 af->frequency/1000.);
 	}
-	af->off = c;
 	af->set = 1;
 	af->framesize = calculate_mpg_framesize(af);
 	//af->framesize = af->bit_rate *slots [3-af->layer]/ af->frequency;
 	if (DEBUG && verb) fprintf(stderr," frame size: %d \n", af->framesize);
-	return c;
+	return 0;
 }
 
-int get_ac3_info(ringbuffer *rbuf, audio_frame_t *af, long off, int le, int verb)
+int get_audio_info(ringbuffer *rbuf, audio_frame_t *af, long off, int le, int verb) 
 {
-	int c=0;
-	uint8_t headr[6];
-	uint8_t frame;
-	int half = 0;
-	int fr;
-	
+	int c = 0;
+	uint8_t headr[4];
 
 	af->set=0;
 
-	if ((c = find_audio_sync(rbuf, headr, off, AC3, le)) < 0 ) 
+	if ( (c = find_audio_sync(rbuf, headr, off, MPEG_AUDIO,le)) < 0 ) 
 		return c;
 
+	if (audio_header_info(headr, af, verb) < 0) return -1;
 	af->off = c;
+	return c;
+}
+
+// reads the AC3 header in headr
+int ac3_header_info(uint8_t *headr, audio_frame_t *af, int verb)
+{
+	uint8_t frame;
+	int half = 0;
+	int fr;
 
+	af->set=0;
 	af->layer = 0;  // 0 for AC3
 
 	if (DEBUG && verb) fprintf (stderr,"AC3 stream:");
@@ -673,8 +675,22 @@ int get_ac3_info(ringbuffer *rbuf, audio_frame_t *af, long off, int le, int verb
 
 	if (DEBUG && verb) fprintf (stderr,"  frame size %d\n", af->framesize);
 
-	af->off = c;
 	af->set = 1;
+	return 0;
+}
+
+int get_ac3_info(ringbuffer *rbuf, audio_frame_t *af, long off, int le, int verb)
+{
+	int c=0;
+	uint8_t headr[6];
+
+	af->set=0;
+
+	if ((c = find_audio_sync(rbuf, headr, off, AC3, le)) < 0 ) 
+		return c;
+
+	ac3_header_info(headr, af, verb);
+	af->off = c;
 	return c;
 }
 
@@ -691,8 +707,8 @@ int get_video_ext_info(ringbuffer *rbuf, sequence_t *s, long off, int le)
 		return re;
 	}
 
-	if (ring_peek(rbuf, buf, 5, off) < 0) return -2;
-	headr=buf+4;
+	if (!(headr = ring_peek_ptr(rbuf, buf, 5, off))) return -2;
+	headr += 4;
 	
 	ext_id = (headr[0]&0xF0) >> 4;
 
@@ -706,8 +722,8 @@ int get_video_ext_info(ringbuffer *rbuf, sequence_t *s, long off, int le)
 
 
 		if (s->ext_set || !s->set) break;
-		if (ring_peek(rbuf, buf, 10, off) < 0) return -2;
-		headr=buf+4;
+		if (!(headr = ring_peek_ptr(rbuf, buf, 10, off))) return -2;
+		headr += 4;
 
 		if (DEBUG) fprintf(stderr,"Sequence Extension:");
 		s->profile = ((headr[0]&0x0F) << 4) | ((headr[1]&0xF0) >> 4);
@@ -766,8 +782,8 @@ int get_video_ext_info(ringbuffer *rbuf, sequence_t *s, long off, int le)
 		int prog_frame = 0;
 
 		if (!s->set || s->pulldown_set) break;
-		if (ring_peek(rbuf, buf, 10, off) < 0) return -2;
-		headr=buf+4;
+		if (!(headr = ring_peek_ptr(rbuf, buf, 10, off))) return -2;
+		headr += 4;
 		
 		if ( (headr[2]&0x03) != 0x03 ) break; // not frame picture
 		if ( (headr[3]&0x02) ) repeat_first = 1; // repeat flag set => pulldown
@@ -134,6 +134,8 @@ int find_audio_s(uint8_t *rbuf, long off, int type, int le);
 int get_video_info(ringbuffer *rbuf, sequence_t *s, long off, int le);
 int get_audio_info(ringbuffer *rbuf, audio_frame_t *af, long off, int le, int verb); 
 int get_ac3_info(ringbuffer *rbuf, audio_frame_t *af, long off, int le, int verb);
+int audio_header_info(uint8_t *headr, audio_frame_t *af, int verb);
+int ac3_header_info(uint8_t *headr, audio_frame_t *af, int verb);
 uint64_t add_pts_audio(uint64_t pts, audio_frame_t *aframe, uint64_t frames);
 uint64_t next_ptsdts_video(uint64_t *pts, sequence_t *s, uint64_t fcount, uint64_t gcount);
 int  cfix_audio_count(audio_frame_t *aframe, uint64_t origpts, uint64_t pts);
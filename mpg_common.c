@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include "element.h"
+#include "mpg_common.h"
 #include "pes.h"
 #include "ts.h"
 
@@ -64,42 +65,127 @@ void show_buf(uint8_t *buf, int length)
 }
 
 //----------------------------------------------------------------------------
-#define CMP_CORE(offset) \
-        x=Data[i+1+offset]; \
-        if (x<2) { \
-                if (x==0) { \
-                        if ( Data[i+offset]==0 && Data[i+2+offset]==1) \
-                                return i+offset; \
-                        else if (Data[i+2+offset]==0 && Data[i+3+offset]==1) \
-                                return i+1+offset; \
-                } \
-                else if (x==1 && Data[i-1+offset]==0 && Data[i+offset]==0 && (i+offset)>0) \
-                         return i-1+offset; \
-         }
+/* start code scanners: all of them store the positions of 00 00 01
+   in buf[0..len-1] into pos and return their number (at most max) */
 
-int FindPacketHeader(const uint8_t *Data, int s, int l)
+static int sc_scan_c(const uint8_t *buf, int len, int *pos, int max)
 {
-        int i;
-        uint8_t x;
-
-        if (l>12) {
-                for(i=s;i<l-12;i+=12) { 
-                        CMP_CORE(0);
-                        CMP_CORE(3);
-                        CMP_CORE(6);
-                        CMP_CORE(9);
-                }
+	int i, n = 0;
 
-                for(; i<l-3; i+=3) {
-                        CMP_CORE(0);
-		}	       
-        }
-        else {
-                for(i=s; i<l-3; i+=3) {
-                        CMP_CORE(0);
+	for (i = 0; i < len-2 && n < max; i++){
+		if (buf[i+2] > 1) {
+			i += 2;
+			continue;
 		}
-        }
-        return -1;
+		if (!buf[i] && !buf[i+1] && buf[i+2] == 1)
+			pos[n++] = i;
+	}
+	return n;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static int sc_scan_sse2(const uint8_t *buf, int len, int *pos, int max)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	int i = 0, n = 0;
+
+	for (; i+18 <= len && n < max; i += 16){
+		__m128i a = _mm_loadu_si128((const __m128i *)(buf+i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(buf+i+1));
+		__m128i c = _mm_loadu_si128((const __m128i *)(buf+i+2));
+		unsigned int m;
+
+		m = _mm_movemask_epi8(_mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(a, zero),
+				      _mm_cmpeq_epi8(b, zero)),
+			_mm_cmpeq_epi8(c, one)));
+		while (m && n < max){
+			pos[n++] = i + __builtin_ctz(m);
+			m &= m-1;
+		}
+	}
+	if (n < max && i < len-2){
+		int j, r;
+
+		r = sc_scan_c(buf+i, len-i, pos+n, max-n);
+		for (j = 0; j < r; j++) pos[n+j] += i;
+		n += r;
+	}
+	return n;
+}
+
+__attribute__((target("avx2")))
+static int sc_scan_avx2(const uint8_t *buf, int len, int *pos, int max)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	int i = 0, n = 0;
+
+	for (; i+34 <= len && n < max; i += 32){
+		__m256i a = _mm256_loadu_si256((const __m256i *)(buf+i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(buf+i+1));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(buf+i+2));
+		unsigned int m;
+
+		m = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(a, zero),
+					 _mm256_cmpeq_epi8(b, zero)),
+			_mm256_cmpeq_epi8(c, one)));
+		while (m && n < max){
+			pos[n++] = i + __builtin_ctz(m);
+			m &= m-1;
+		}
+	}
+	if (n < max && i < len-2){
+		int j, r;
+
+		r = sc_scan_sse2(buf+i, len-i, pos+n, max-n);
+		for (j = 0; j < r; j++) pos[n+j] += i;
+		n += r;
+	}
+	return n;
+}
+#endif
+
+static int (*sc_scan)(const uint8_t *buf, int len, int *pos, int max) = 
+	sc_scan_c;
+
+/* picks the scanner for this CPU, called once before any thread 
+   starts to scan */
+void sc_init(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		sc_scan = sc_scan_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		sc_scan = sc_scan_sse2;
+#endif
+}
+
+int find_start_codes(const uint8_t *buf, int len, int *pos, int max)
+{
+	if (len < 3 || max <= 0) return 0;
+	return sc_scan(buf, len, pos, max);
+}
+
+/* returns the position of the first start code that begins at or one
+   byte before s and whose 01 lies before l-1 in steps of 3 from s,
+   the range the old stride 3 scanner covered */
+int FindPacketHeader(const uint8_t *Data, int s, int l)
+{
+	int lo, hi, p;
+
+	if (l-4 < s) return -1;
+	lo = s ? s-1 : 0;
+	hi = s + 3*((l-4-s)/3) + 1;
+	if (find_start_codes(Data+lo, hi-lo+3, &p, 1))
+		return lo+p;
+	return -1;
 }
 //----------------------------------------------------------------------------
 
@@ -250,7 +336,8 @@ int mring_peek( ringbuffer *rbuf, uint8_t *buf, int l, long off)
 
 
 
-int ring_find_mpg_header(ringbuffer *rbuf, uint8_t head, int off, int le)
+// byte by byte version for searches that run past the data
+static int ring_find_mpg_header_b(ringbuffer *rbuf, uint8_t head, int off, int le)
 {
 
 	int c = 0;
@@ -289,6 +376,83 @@ int ring_find_mpg_header(ringbuffer *rbuf, uint8_t head, int off, int le)
 }
 
 
+#define SC_BATCH 32
+/* start codes in the le bytes at off of the ring, from cur on, the
+   positions are relative to off and ascending, a code may straddle
+   the end of the buffer */
+static int ring_start_codes(struct iovec *iov, int niov, int cur, int le,
+			    int *pos, int max)
+{
+	uint8_t *b0 = iov[0].iov_base;
+	int l0 = iov[0].iov_len;
+	int n = 0, i, start;
+
+	if (cur < l0){
+		n = find_start_codes(b0+cur, l0-cur, pos, max);
+		for (i = 0; i < n; i++) pos[i] += cur;
+		if (n || niov == 1) return n;
+	}
+
+	// codes across the end of the buffer
+	for (i = (cur > l0-2 ? cur : l0-2); i < l0 && i+2 < le; i++){
+		uint8_t b[3];
+		int j;
+
+		for (j = 0; j < 3; j++)
+			b[j] = (i+j < l0) ? b0[i+j] : 
+				((uint8_t *)iov[1].iov_base)[i+j-l0];
+		if (!b[0] && !b[1] && b[2] == 1) pos[n++] = i;
+	}
+	if (n) return n;
+
+	start = cur > l0 ? cur : l0;
+	if (start >= le) return 0;
+	n = find_start_codes((uint8_t *)iov[1].iov_base + start-l0, le-start,
+			     pos, max);
+	for (i = 0; i < n; i++) pos[i] += start;
+	return n;
+}
+
+static uint8_t ring_byte(struct iovec *iov, int x)
+{
+	if (x < iov[0].iov_len) return ((uint8_t *)iov[0].iov_base)[x];
+	return ((uint8_t *)iov[1].iov_base)[x-iov[0].iov_len];
+}
+
+/* block wise search for 00 00 01 head with the results of the byte
+   wise state machine: a start code right after one that was followed
+   by the wrong byte is not seen, -2 means a partial match at the end */
+int ring_find_mpg_header(ringbuffer *rbuf, uint8_t head, int off, int le)
+{
+	struct iovec iov[2];
+	int pos[SC_BATCH];
+	int niov, n, i;
+	int cur = 0;
+	int last = -4;
+
+	if (le <= 0) return -1;
+	if (le > ring_avail(rbuf) - off || ring_avail(rbuf) + off <= 1)
+		return ring_find_mpg_header_b(rbuf, head, off, le);
+	if ((niov = ring_iov(rbuf, iov, le, off)) < 0) return -1;
+
+	while ((n = ring_start_codes(iov, niov, cur, le, pos, SC_BATCH))){
+		for (i = 0; i < n; i++){
+			if (pos[i] == last+3) continue; // not seen
+			if (pos[i]+3 >= le){
+				last = pos[i];
+				break;
+			}
+			if (ring_byte(iov, pos[i]+3) == head) return pos[i];
+			last = pos[i];
+		}
+		cur = pos[n-1]+1;
+	}
+
+	if (last == le-3) return -2;
+	if (!ring_byte(iov, le-1) && last != le-4) return -2;
+	return -1;
+}
+
 #define PEEK_SIZE (512+1024)
 int ring_find_any_headery(ringbuffer *rbuf, uint8_t *head, int off, int le)
 {
@@ -339,7 +503,7 @@ int ring_find_any_headery(ringbuffer *rbuf, uint8_t *head, int off, int le)
 	return -1; // Not found
 }
 
-int ring_find_any_headerx(ringbuffer *rbuf, uint8_t *head, int off, int le)
+static int ring_find_any_headerx_b(ringbuffer *rbuf, uint8_t *head, int off, int le)
 {
 
 	int c = 0;
@@ -378,6 +542,28 @@ int ring_find_any_headerx(ringbuffer *rbuf, uint8_t *head, int off, int le)
 	else return -1;
 }
 
+int ring_find_any_headerx(ringbuffer *rbuf, uint8_t *head, int off, int le)
+{
+	struct iovec iov[2];
+	int pos;
+	int niov;
+
+	if (le <= 0) return -1;
+	if (le > ring_avail(rbuf) - off || ring_avail(rbuf) + off <= 1)
+		return ring_find_any_headerx_b(rbuf, head, off, le);
+	if ((niov = ring_iov(rbuf, iov, le, off)) < 0) return -1;
+
+	if (ring_start_codes(iov, niov, 0, le, &pos, 1)){
+		if (pos+3 < le){
+			*head = ring_byte(iov, pos+3);
+			return pos;
+		}
+		return -2;
+	}
+	if (!ring_byte(iov, le-1)) return -2;
+	return -1;
+}
+
 int ring_find_any_header(ringbuffer *rbuf, uint8_t *head, int off, int le)
 {
 	uint8_t a=0;
@@ -394,3 +580,101 @@ int ring_find_any_header(ringbuffer *rbuf, uint8_t *head, int off, int le)
 	*head=a;
 	return x;
 }
+
+// start codes from t->end on, positions relative to the payload at off
+static void sc_table_fill(sc_table_t *t, ringbuffer *rbuf, int start, 
+			  int off, int le)
+{
+	struct iovec iov[2];
+	int pos[SC_BATCH];
+	int niov, n, i;
+	int cur = 0;
+
+	t->n = 0;
+	t->next = 0;
+	if (start >= le){
+		t->end = le;
+		return;
+	}
+	if (off+start < 0 || 
+	    (niov = ring_iov(rbuf, iov, le-start, off+start)) < 0){
+		t->valid = 0;
+		return;
+	}
+
+	while ((n = ring_start_codes(iov, niov, cur, le-start, pos, SC_BATCH))){
+		for (i = 0; i < n; i++){
+			if (start+pos[i]+3 >= le){
+				t->end = le;
+				return;
+			}
+			if (t->n == SC_TABLE){
+				t->end = start+pos[i];
+				return;
+			}
+			t->sc[t->n].pos = start+pos[i];
+			t->sc[t->n].code = ring_byte(iov, pos[i]+3);
+			t->n++;
+		}
+		cur = pos[n-1]+1;
+	}
+	t->end = le;
+}
+
+void sc_table_init(sc_table_t *t, ringbuffer *rbuf, int off, int le)
+{
+	t->valid = 1;
+	sc_table_fill(t, rbuf, 0, off, le);
+}
+
+/* same result as ring_find_any_header(rbuf, head, c+off, le-c), with
+   c counted from the start of the payload, but taken from the table */
+int sc_table_find(sc_table_t *t, ringbuffer *rbuf, uint8_t *head, int c, 
+		  int off, int le)
+{
+	uint8_t buf[4];
+	int i, s;
+
+	// the peek in ring_find_any_headery fails for a window
+	// that ends exactly at the end of the data
+	if (!t->valid || c+off == 0) 
+		return ring_find_any_header(rbuf, head, c+off, le-c);
+
+	*head = 0;
+	if (le-c <= 0) return -1;
+	for(;;){
+		while (t->next < t->n && t->sc[t->next].pos < c) t->next++;
+		if (t->next < t->n){
+			*head = t->sc[t->next].code;
+			return t->sc[t->next].pos - c;
+		}
+		if (t->end >= le) break;
+		sc_table_fill(t, rbuf, t->end > c ? t->end : c, off, le);
+		if (!t->valid)
+			return ring_find_any_header(rbuf, head, c+off, le-c);
+	}
+
+	// a zero in the last 4 bytes may start a code
+	s = le-4 > c ? le-4 : c;
+	if (ring_peek(rbuf, buf, le-s, off+s) < 0) return -1;
+	for (i = 0; i < le-s; i++)
+		if (!buf[i]) return -2;
+	return -1;
+}
+
+int index_init(ringbuffer *rbuf, int size)
+{
+	return ring_init(rbuf, size - size % sizeof(index_unit));
+}
+
+// turn a fill run into its next frame
+void index_repeat(index_unit *iu)
+{
+	audio_frame_t af;
+
+	af.layer = iu->layer;
+	af.frequency = iu->frequency;
+	iu->repeat--;
+	iu->dts++;
+	iu->pts = add_pts_audio(0, &af, iu->dts);
+}
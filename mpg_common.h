@@ -35,11 +35,16 @@
 
 
 typedef struct index_unit_s{
-	uint8_t  active;
-	uint32_t length;
-	uint32_t start;
 	uint64_t pts;
 	uint64_t dts;
+	uint8_t  *fillframe;
+	uint32_t length;
+	uint32_t start;
+	int      framesize;
+	uint32_t frequency;
+	uint16_t repeat;
+	uint8_t  layer;
+	uint8_t  active;
 	uint8_t  seq_header;
 	uint8_t  seq_end;
 	uint8_t  gop;
@@ -49,8 +54,6 @@ typedef struct index_unit_s{
 	uint8_t  frame_off;
 	uint8_t  frame_start;
 	uint8_t  err;
-	int      framesize;
-	uint8_t  *fillframe;
 } index_unit;
 
 #define NO_ERR    0
@@ -60,12 +63,106 @@ typedef struct index_unit_s{
 #define DUMMY_ERR 4
 #define DROP_ERR 5
 
+/* a unit with DUMMY_ERR stands for repeat more fill frames after
+   itself, dts counts the frames so that layer and frequency give 
+   their PTS */
+#define MAX_REPEAT 0xFFFF
+
+/* index rings are ringbuffers of whole index_units, their size is a
+   multiple of the unit so that a unit never wraps and can be used 
+   in place */
+int index_init(ringbuffer *rbuf, int size);
+void index_repeat(index_unit *iu);
+
+static inline int index_avail(ringbuffer *rbuf)
+{
+	return ring_avail(rbuf)/sizeof(index_unit);
+}
+
+// n-th unit in the ring, NULL if there is none
+static inline index_unit *index_peek(ringbuffer *rbuf, int n)
+{
+	int pos;
+
+	if (n >= index_avail(rbuf)) return NULL;
+	pos = rbuf->read_pos + n*sizeof(index_unit);
+	if (pos >= rbuf->size) pos -= rbuf->size;
+	return (index_unit *)(rbuf->buffer + pos);
+}
+
+/* units left, with the frames of a fill run at the head, so that it
+   changes with every unit read */
+static inline int index_left(ringbuffer *rbuf)
+{
+	index_unit *iu;
+
+	if (!(iu = index_peek(rbuf, 0))) return 0;
+	return index_avail(rbuf) + iu->repeat;
+}
+
+static inline void index_skip(ringbuffer *rbuf)
+{
+	index_unit *iu = (index_unit *)(rbuf->buffer + rbuf->read_pos);
+	int pos;
+
+	if (iu->repeat){
+		index_repeat(iu);
+		return;
+	}
+	pos = rbuf->read_pos + sizeof(index_unit);
+	if (pos >= rbuf->size) pos -= rbuf->size;
+	rbuf->read_pos = pos;
+}
+
+static inline int index_read(ringbuffer *rbuf, index_unit *iu)
+{
+	index_unit *p;
+
+	if (!(p = index_peek(rbuf, 0))) return 0;
+	*iu = *p;
+	index_skip(rbuf);
+	return 1;
+}
+
+static inline int index_write(ringbuffer *rbuf, index_unit *iu)
+{
+	int pos;
+
+	if (ring_free(rbuf) < sizeof(index_unit)) return FULL_BUFFER;
+	*(index_unit *)(rbuf->buffer + rbuf->write_pos) = *iu;
+	pos = rbuf->write_pos + sizeof(index_unit);
+	if (pos >= rbuf->size) pos -= rbuf->size;
+	rbuf->write_pos = pos;
+	return 1;
+}
+
+#define SC_TABLE 1024
+/* start codes of one PES payload, found in a single pass */
+typedef struct sc_entry_s{
+	int      pos;
+	uint8_t  code;
+} sc_entry;
+
+typedef struct sc_table_s{
+	sc_entry sc[SC_TABLE];
+	int      n;
+	int      next;
+	int      end;
+	int      valid;
+} sc_table_t;
+
 void show_buf(uint8_t *buf, int length);
+void sc_init(void);
+int find_start_codes(const uint8_t *buf, int len, int *pos, int max);
+int FindPacketHeader(const uint8_t *Data, int s, int l);
 int find_mpg_header(uint8_t head, uint8_t *buf, int length);
 int find_any_header(uint8_t *head, uint8_t *buf, int length);
 uint64_t trans_pts_dts(uint8_t *pts);
 int mring_peek( ringbuffer *rbuf, uint8_t *buf, int l, long off);
 int ring_find_mpg_header(ringbuffer *rbuf, uint8_t head, int off, int le);
 int ring_find_any_header(ringbuffer *rbuf, uint8_t *head, int off, int le);
+void sc_table_init(sc_table_t *t, ringbuffer *rbuf, int off, int le);
+int sc_table_find(sc_table_t *t, ringbuffer *rbuf, uint8_t *head, int c, 
+		  int off, int le);
 
 #endif /*_MPG_COMMON_H_*/
@@ -26,16 +26,276 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "multiplex.h"
 
+static int write_all(int fd, uint8_t *buffer, int length)
+{
+	int k, re=0;
 
-static int mplx_write(multiplex_t *mx, uint8_t *buffer,int length)
+	while (re < length){
+		if ((k=write(fd, buffer+re, length-re)) <= 0) break;
+		re += k;
+	}
+	return re;
+}
+
+static void mplx_flush(multiplex_t *mx, int final)
+{
+	int k, l;
+
+	l = mx->obuf_len;
+	if (!l) return;
+
+	// O_DIRECT only takes aligned blocks, keep the rest for later
+	if (mx->direct) l -= l % OUT_ALIGN;
+	if (final && l < mx->obuf_len){
+		k = write_all(mx->fd_out, mx->obuf, l);
+		if (k == l){
+			fcntl(mx->fd_out, F_SETFL, 
+			      fcntl(mx->fd_out, F_GETFL) & ~O_DIRECT);
+			mx->direct = 0;
+			k += write_all(mx->fd_out, mx->obuf+l, 
+				       mx->obuf_len-l);
+		}
+		l = mx->obuf_len;
+	} else k = write_all(mx->fd_out, mx->obuf, l);
+
+	if (k < l){
+		mx->zero_write_count += mx->obuf_count;
+		mx->total_written -= l-k;
+	}
+	mx->obuf_len -= l;
+	if (mx->obuf_len) memmove(mx->obuf, mx->obuf+l, mx->obuf_len);
+	mx->obuf_count = 0;
+}
+
+/* the multiplexer whose buffer still has to go out if we exit early,
+   and the thread that writes it */
+static multiplex_t *exit_mx = NULL;
+static pthread_t exit_owner;
+
+void flush_mpg(multiplex_t *mx)
+{
+	mplx_flush(mx, 1);
+	if (exit_mx == mx) exit_mx = NULL;
+}
+
+/* a demux thread or audio worker that exits may find the owner in
+   the middle of a write, the buffer is only its own to flush */
+static void mplx_exit(void)
+{
+	if (exit_mx && pthread_equal(pthread_self(), exit_owner))
+		flush_mpg(exit_mx);
+}
+
+static int iov_length(struct iovec *iov, int n)
+{
+	int i, length = 0;
+
+	for (i = 0; i < n; i++) length += iov[i].iov_len;
+	return length;
+}
+
+// one pack from header and ring segments, copied once into the buffer
+static int mplx_outv(multiplex_t *mx, struct iovec *iov, int n)
+{
+	int k=0, i;
+	int length = iov_length(iov, n);
+
+	if (!mx->obuf || length <= 0){
+		if ((k=writev(mx->fd_out, iov, n)) <= 0){
+			mx->zero_write_count++;
+		} else {
+			mx->total_written += k;
+		}
+		return k;
+	}
+
+	if (mx->obuf_len + length > OUT_BUF) mplx_flush(mx, 0);
+	for (i = 0; i < n; i++){
+		memcpy(mx->obuf+mx->obuf_len, iov[i].iov_base, iov[i].iov_len);
+		mx->obuf_len += iov[i].iov_len;
+	}
+	mx->obuf_count++;
+	mx->total_written += length;
+
+	return length;
+}
+
+static int mplx_out(multiplex_t *mx, uint8_t *buffer,int length)
+{
+	struct iovec iov;
+
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+	return mplx_outv(mx, &iov, 1);
+}
+
+// TS output
+#define TS_PES       11   // TS packets for the PES of a pack
+#define TS_PMT_PID   0x0100
+#define TS_VIDEO_PID 0x0200
+#define TS_AUDIO_PID 0x0300
+#define TS_AC3_PID   0x0400
+#define NULL_PID     0x1FFF
+#define PCR_INTERVAL (30*CLOCK_MS)  // DVB wants at most 40ms
+#define PSI_INTERVAL (100*CLOCK_MS)
+// PAT, PMT and PCR packets per second
+#define TS_PSI_RATE  (2*1000/(PSI_INTERVAL/CLOCK_MS) + \
+		      1000/(PCR_INTERVAL/CLOCK_MS))
+
+// time of the next packet, with a constant rate from the packet count
+static uint64_t ts_time(multiplex_t *mx)
+{
+	uint64_t q, r;
+
+	if (!mx->ts_rate) return mx->ts_clock;
+	q = mx->ts_count / mx->ts_rate;
+	r = mx->ts_count % mx->ts_rate;
+	return (mx->ts_start + q*TS_SIZE*8ULL*27000000ULL + 
+		r*TS_SIZE*8ULL*27000000ULL/mx->ts_rate) % MAX_PTS2;
+}
+
+static void ts_put(multiplex_t *mx, uint8_t *tsp)
+{
+	mplx_out(mx, tsp, TS_SIZE);
+	mx->ts_count++;
+}
+
+static void ts_null(multiplex_t *mx)
 {
-	int k=0;
+	uint8_t tsp[TS_SIZE];
+	int c;
+
+	c = write_ts_header(NULL_PID, &mx->null_cc, 0, tsp, TS_SIZE-4, NULL);
+	memset(tsp+c, 0xFF, TS_SIZE-c);
+	ts_put(mx, tsp);
+}
+
+// PAT and PMT or a PCR without payload when they are due
+static int ts_tables(multiplex_t *mx)
+{
+	uint8_t tsp[TS_SIZE];
+	uint64_t t = ts_time(mx);
+	int n = 0;
+
+	if (!mx->ts_started || ptsdiff(t, mx->last_psi) >= PSI_INTERVAL){
+		write_pat(&mx->tsprog, &mx->pat_cc, tsp);
+		ts_put(mx, tsp);
+		write_pmt(&mx->tsprog, &mx->pmt_cc, tsp);
+		ts_put(mx, tsp);
+		mx->last_psi = t;
+		n += 2;
+		t = ts_time(mx);
+	}
+	if (!mx->ts_started || ptsdiff(t, mx->last_pcr) >= PCR_INTERVAL){
+		write_ts_header(mx->tsprog.pcr_pid, &mx->vcc, 0, tsp, 0, &t);
+		ts_put(mx, tsp);
+		mx->last_pcr = t;
+		n++;
+	}
+	mx->ts_started = 1;
+
+	return n;
+}
+
+// a PES in TS packets, the first one carries the PCR if pcr is set
+static void ts_write_pes(multiplex_t *mx, uint16_t pid, uint8_t *cc, 
+			 uint8_t *pes, int len, int pcr)
+{
+	uint8_t tsp[TS_SIZE];
+	int c = 0;
+
+	while (c < len){
+		uint64_t t = ts_time(mx);
+		int l = TS_SIZE-4;
+		int h;
+
+		if (pcr) l -= 8;
+		if (l > len-c) l = len-c;
+		h = write_ts_header(pid, cc, !c, tsp, l, pcr ? &t : NULL);
+		memcpy(tsp+h, pes+c, l);
+		if (pcr) mx->last_pcr = t;
+		pcr = 0;
+		c += l;
+		ts_put(mx, tsp);
+	}
+}
+
+/* cuts the PES packets of a pack into TS packets, the pack only gives
+   the time, padding becomes null packets for a constant rate and is
+   left out otherwise */
+static int ts_write_pack(multiplex_t *mx, uint8_t *buf, int length)
+{
+	uint8_t pes[3000];
+	int c, l, hl, n;
+
+	if (length < PS_HEADER_L1 || buf[3] != PACK_START) return length;
+
+	if (!mx->ts_started) mx->ts_start = mx->SCR;
+	if (mx->ts_rate){
+		while (ptscmp(ts_time(mx), mx->SCR) < 0)
+			if (!ts_tables(mx)) ts_null(mx);
+	} else {
+		// the clock may jump, but not over a PCR
+		while (mx->ts_started && 
+		       ptsdiff(mx->SCR, mx->last_pcr) > PCR_INTERVAL){
+			mx->ts_clock = ptsadd(mx->last_pcr, PCR_INTERVAL);
+			ts_tables(mx);
+		}
+		mx->ts_clock = mx->SCR;
+	}
+	ts_tables(mx);
+
+	c = PS_HEADER_L1 + (buf[13] & 0x07);
+	while (c+6 <= length && !buf[c] && !buf[c+1] && buf[c+2] == 0x01){
+		uint8_t id = buf[c+3];
+
+		l = 6 + ((buf[c+4] << 8) | buf[c+5]);
+		if (c+l > length) break;
+
+		switch (id){
+		case VIDEO_STREAM_S:
+			ts_write_pes(mx, TS_VIDEO_PID, &mx->vcc, buf+c, l, 1);
+			break;
+
+		case PRIVATE_STREAM1: // AC3 without the substream header
+			hl = PES_H_MIN + buf[c+8];
+			if (l < hl+4) break;
+			n = buf[c+hl] - 0x80 - mx->apidn;
+			if (n < 0 || n >= mx->ac3n) break;
+			memcpy(pes, buf+c, hl);
+			memcpy(pes+hl, buf+c+hl+4, l-hl-4);
+			pes[4] = (uint8_t)((l-10) >> 8);
+			pes[5] = (uint8_t)(l-10);
+			ts_write_pes(mx, TS_AC3_PID+n, &mx->ac3cc[n], pes, l-4, 0);
+			break;
+
+		default:
+			n = id - AUDIO_STREAM_S;
+			if (id >= AUDIO_STREAM_S && n < mx->apidn)
+				ts_write_pes(mx, TS_AUDIO_PID+n, &mx->acc[n], 
+					     buf+c, l, 0);
+			break;
+		}
+		c += l;
+	}
+
+	return length;
+}
+
+static int mplx_writev(multiplex_t *mx, struct iovec *iov, int n)
+{
+	uint8_t pack[3000];
+	int length = iov_length(iov, n);
+	int i, c;
 
 	if ( mx->max_write && mx->total_written+ length >  
 	     mx-> max_write && !mx->max_reached){
@@ -43,67 +303,80 @@ static int mplx_write(multiplex_t *mx, uint8_t *buffer,int length)
 		fprintf(stderr,"Maximum file size %dKB reached\n", mx->max_write/1024);
 		return 0;
 	}
-	if ((k=write(mx->fd_out, buffer, length)) <= 0){
-		mx->zero_write_count++;
-	} else {
-		mx->total_written += k;
+	if (mx->otype == REPLEX_MPEGTS){
+		if (n == 1) 
+			return ts_write_pack(mx, iov[0].iov_base, length);
+		for (i = 0, c = 0; i < n; c += iov[i].iov_len, i++)
+			memcpy(pack+c, iov[i].iov_base, iov[i].iov_len);
+		return ts_write_pack(mx, pack, length);
 	}
-	return k;
+	return mplx_outv(mx, iov, n);
+}
+
+static int mplx_write(multiplex_t *mx, uint8_t *buffer,int length)
+{
+	struct iovec iov;
+
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+	return mplx_writev(mx, &iov, 1);
+}
+
+int set_direct_io(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0) return -1;
+	return fcntl(fd, F_SETFL, flags | O_DIRECT);
 }
 
 static int buffers_filled(multiplex_t *mx)
 {
 	int vavail=0, aavail=0, i;
 
-	vavail = ring_avail(mx->index_vrbuffer)/sizeof(index_unit);
+	vavail = index_avail(mx->index_vrbuffer);
 	
 	for (i=0; i<mx->apidn;i++){
-		aavail += ring_avail(&mx->index_arbuffer[i])/sizeof(index_unit);
+		aavail += index_left(&mx->index_arbuffer[i]);
 	}
 
 	for (i=0; i<mx->ac3n;i++){
-		aavail += ring_avail(&mx->index_ac3rbuffer[i])
-			/sizeof(index_unit);
+		aavail += index_left(&mx->index_ac3rbuffer[i]);
 	}
 	if (aavail+vavail) return ((aavail+vavail));
 	return 0;
 }
 
-static int all_audio_ok(int *aok, int n)
+static uint32_t audio_mask(int n)
 {
-	int ok=0,i;
+	if (n >= 32) return ~0U;
+	return (1U << n) - 1;
+}
 
+static int all_audio_ok(uint32_t aok, int n)
+{
 	if (!n) return 0;
-	for (i=0;  i < n ;i++){
-		if (aok[i]) ok ++;
-	}
-	if (ok == n) return 1;
+	if (aok == audio_mask(n)) return 1;
 	return 0;
 }
 
-static int rest_audio_ok(int j, int *aok, int n)
+static int rest_audio_ok(int j, uint32_t aok, int n)
 {
-	int ok=0,i;
-
 	if (!(n-1)) return 0;
-	for (i=0;  i < n ;i++){
-		if (i!=j && aok[i]) ok ++;
-	}
-	if (ok == n) return 1;
+	if ((aok & ~(1U << j)) == audio_mask(n)) return 1;
 	return 0;
 }
 
 static int get_next_video_unit(multiplex_t *mx, index_unit *viu)
 {
-	if (!ring_avail(mx->index_vrbuffer) && mx->finish) return 0;
+	if (!index_avail(mx->index_vrbuffer) && mx->finish) return 0;
 
-	while (ring_avail(mx->index_vrbuffer) < sizeof(index_unit))
+	while (!index_read(mx->index_vrbuffer, viu))
 		if (mx->fill_buffers(mx->priv, mx->finish)< 0) {
 			fprintf(stderr,"error in get next video unit\n");
 			return 0;
 		}
 
-	ring_read(mx->index_vrbuffer, (uint8_t *)viu, sizeof(index_unit));
 #ifdef OUT_DEBUG
 	fprintf(stderr,"video index start: %d  stop: %d  (%d)  rpos: %d\n", 
 		viu->start, (viu->start+viu->length),
@@ -113,37 +386,37 @@ static int get_next_video_unit(multiplex_t *mx, index_unit *viu)
 	return 1;
 }
 
-static int peek_next_video_unit(multiplex_t *mx, index_unit *viu)
+// the unit stays in the ring, the pointer is valid until it is read
+static index_unit *peek_next_video_unit(multiplex_t *mx)
 {
-	if (!ring_avail(mx->index_vrbuffer) && mx->finish) return 0;
+	index_unit *viu;
+
+	if (!index_avail(mx->index_vrbuffer) && mx->finish) return NULL;
 
-	while (ring_avail(mx->index_vrbuffer) < sizeof(index_unit))
+	while (!(viu = index_peek(mx->index_vrbuffer, 0)))
 		if (mx->fill_buffers(mx->priv, mx->finish)< 0) {
 			fprintf(stderr,"error in peek next video unit\n");
-			return 0;
+			return NULL;
 		}
 
-	ring_peek(mx->index_vrbuffer, (uint8_t *)viu, sizeof(index_unit),0);
 #ifdef OUT_DEBUG
 	fprintf(stderr,"video index start: %d  stop: %d  (%d)  rpos: %d\n", 
 		viu->start, (viu->start+viu->length),
 		viu->length, ring_rpos(mx->vrbuffer));
 #endif
 
-	return 1;
+	return viu;
 }
 	
 static int get_next_audio_unit(multiplex_t *mx, index_unit *aiu, int i)
 {
-	if (!ring_avail(&mx->index_arbuffer[i]) && mx->finish) return 0;
+	if (!index_avail(&mx->index_arbuffer[i]) && mx->finish) return 0;
 
-	while(ring_avail(&mx->index_arbuffer[i]) < sizeof(index_unit))
+	while(!index_read(&mx->index_arbuffer[i], aiu))
 		if (mx->fill_buffers(mx->priv, mx->finish)< 0) {
 			fprintf(stderr,"error in get next audio unit\n");
 			return 0;
 		}
-	
-	ring_read(&mx->index_arbuffer[i], (uint8_t *)aiu, sizeof(index_unit));
 
 #ifdef OUT_DEBUG
 	fprintf(stderr,"audio index start: %d  stop: %d  (%d)  rpos: %d\n", 
@@ -155,20 +428,20 @@ static int get_next_audio_unit(multiplex_t *mx, index_unit *aiu, int i)
 
 static int get_next_ac3_unit(multiplex_t *mx, index_unit *aiu, int i)
 {
-	if (!ring_avail(&mx->index_ac3rbuffer[i]) && mx->finish) return 0;
-	while(ring_avail(&mx->index_ac3rbuffer[i]) < sizeof(index_unit))
+	if (!index_avail(&mx->index_ac3rbuffer[i]) && mx->finish) return 0;
+	while(!index_read(&mx->index_ac3rbuffer[i], aiu))
 		if (mx->fill_buffers(mx->priv, mx->finish)< 0) {
 			fprintf(stderr,"error in get next ac3 unit\n");
 			return 0;
 		}
-	
-	ring_read(&mx->index_ac3rbuffer[i], (uint8_t *)aiu, sizeof(index_unit));
 	return 1;
 }
 
 static void writeout_video(multiplex_t *mx)
 {  
 	uint8_t outbuf[3000];
+	struct iovec iov[4];
+	int niov;
 	int written=0;
 	uint8_t ptsdts=0;
 	int length;
@@ -202,10 +475,10 @@ static void writeout_video(multiplex_t *mx)
 			  , length);
 
 	while (length  < mx->data_size ){
-		index_unit nviu;
-		if ( peek_next_video_unit(mx, &nviu)){
-			if (!(nviu.seq_header && nviu.gop && 
-			      nviu.frame == I_FRAME)){
+		index_unit *nviu;
+		if ((nviu = peek_next_video_unit(mx))){
+			if (!(nviu->seq_header && nviu->gop && 
+			      nviu->frame == I_FRAME)){
 				get_next_video_unit(mx, viu);
 				length += viu->length; 
 				if  (length  < mx->data_size )
@@ -249,21 +522,32 @@ static void writeout_video(multiplex_t *mx)
 
 
 	nlength = length;
-	written = write_video_pes( mx->pack_size, mx->apidn, mx->ac3n, 
-				   viu->pts+mx->video_delay, 
-				   viu->dts+mx->video_delay, 
-				   mx->SCR, mx->muxr, outbuf, &nlength, ptsdts,
-				   mx->vrbuffer);
+	if ((niov = vwrite_video_pes( mx->pack_size, &mx->vtmpl, 
+				      viu->pts+mx->video_delay, 
+				      viu->dts+mx->video_delay, 
+				      mx->SCR, outbuf, &nlength, ptsdts, 
+				      mx->vrbuffer, iov)) < 0){
+		niov = 0;
+		nlength = 0;
+	}
+	if (viu->gop){
+		uint8_t pack[3000];
+		int i;
+
+		// the time code of the GOP header is set in a copy of the pack
+		for (i = 0; i < niov; i++){
+			memcpy(pack+written, iov[i].iov_base, iov[i].iov_len);
+			written += iov[i].iov_len;
+		}
+		pts2time( viu->pts + mx->video_delay, pack, written);
+		mplx_write(mx, pack, written);
+	} else mplx_writev(mx, iov, niov);
+	ring_skip(mx->vrbuffer, nlength);
 
 	length -= nlength;
 	dummy_add(&mx->vdbuf, uptsdiff( viu->dts+mx->video_delay,0)
 		  , viu->length-length);
 	viu->length = length;
-	if (viu->gop){
-		pts2time( viu->pts + mx->video_delay, outbuf, written);
-	}
-
-	mplx_write(mx, outbuf, written);
 	
 	if (viu->length == 0){
 		get_next_video_unit(mx, viu);
@@ -273,20 +557,47 @@ static void writeout_video(multiplex_t *mx)
 
 
 #define INSIZE 6000
-int add_to_inbuf(uint8_t *inbuf,ringbuffer *arbuffer, int inbc, int off, int length)
+#define AIOV 128
+// the frames of an audio pack stay where they are until it is written
+static int add_to_iov(struct iovec *src, int *nsrc, uint8_t *data, int length)
+{
+	struct iovec *last = src + *nsrc - 1;
+
+	if (*nsrc && (uint8_t *)last->iov_base + last->iov_len == data){
+		last->iov_len += length;
+		return length;
+	}
+	if (*nsrc == AIOV) {
+		fprintf(stderr,"too many frames in write_out_audio\n");
+		return 0;
+	}
+	src[*nsrc].iov_base = data;
+	src[*nsrc].iov_len = length;
+	(*nsrc)++;
+	return length;
+}
+
+static int add_to_inbuf(struct iovec *src, int *nsrc, ringbuffer *arbuffer, 
+			int inbc, int off, int length)
 {  
-	int add;
+	struct iovec iov[2];
+	int i, n;
 	
 	if (inbc + length > INSIZE) {
 		fprintf(stderr,"buffer too small in write_out_audio %d %d\n",inbc,length);
 		return 0;
 	}
-	add= ring_peek( arbuffer, inbuf+inbc, length, off);
-	if (add < length) {
-		fprintf(stderr,"error while peeking audio ring %d (%d)\n", add,length);
+	if ((n = ring_iov( arbuffer, iov, length, off)) < 0){
+		fprintf(stderr,"error while peeking audio ring (%d)\n", length);
+		return 0;
+	}
+	if (*nsrc+n > AIOV) {
+		fprintf(stderr,"too many frames in write_out_audio\n");
 		return 0;
 	}
-	return add;
+	for (i = 0; i < n; i++)
+		add_to_iov(src, nsrc, iov[i].iov_base, iov[i].iov_len);
+	return length;
 }
 
 
@@ -330,27 +641,12 @@ static void clear_audio(multiplex_t *mx, int type, int n)
 
 
 
-static void my_memcpy(uint8_t *target, int offset, uint8_t *source, int length, int maxlength)
-{
-	uint8_t *targ = NULL;
-
-	targ = target + offset;
-	
-	if ( offset+length > maxlength){
-		fprintf(stderr,"WARNING: buffer overflow in my_memcopy \n");
-//		fprintf(stderr, "source 0x%x  offset %d target 0x%x  length %d maxlength %d\n"
-//			, source, offset, target, length, maxlength);
-	}
-	memcpy(targ, source, length);
-}
-
-
 static void writeout_audio(multiplex_t *mx, int type, int n)
 {  
 	uint8_t outbuf[3000];
-	uint8_t inbuf[INSIZE];
+	struct iovec src[AIOV], iov[AIOV+2];
+	int nsrc=0, niov;
 	int inbc=0;
-	int written=0;
 	int length=0;
 	dummy_buffer *dbuf;
 	ringbuffer *airbuffer;
@@ -420,7 +716,7 @@ static void writeout_audio(multiplex_t *mx, int type, int n)
 	switch (aiu->err){
 		
 	case NO_ERR:
-		add = add_to_inbuf(inbuf, arbuffer, inbc, off, aiu->length);
+		add = add_to_inbuf(src, &nsrc, arbuffer, inbc, off, aiu->length);
 		off += add;
 		inbc += add;
 		break;
@@ -431,10 +727,8 @@ static void writeout_audio(multiplex_t *mx, int type, int n)
 		break;
 	case DUMMY_ERR:
 	  if (aiu->fillframe){
-//		  fprintf(stderr,"1. memcopy 0x%x\n",aiu->fillframe);
-			my_memcpy(inbuf, inbc
-			       , aiu->fillframe + aframesize - length
-				  , length, INSIZE);
+			add_to_iov(src, &nsrc, 
+				   aiu->fillframe + aframesize - length, length);
 			inbc += length;
 			fakelength += length;
 		} else fprintf(stderr,"no fillframe \n");
@@ -456,7 +750,7 @@ static void writeout_audio(multiplex_t *mx, int type, int n)
 	fprintf(stderr,"\n");
 #endif
 	while (length  < mx->data_size + rest_data){
-		if (ring_read(airbuffer, (uint8_t *)aiu, sizeof(index_unit)) > 0){
+		if (index_read(airbuffer, aiu)){
 			
 			dpts = uptsdiff(aiu->pts +mx->audio_delay, adelay );
 			
@@ -470,7 +764,8 @@ static void writeout_audio(multiplex_t *mx, int type, int n)
 			{
 			case NO_ERR:
 				length += aiu->length;
-				add = add_to_inbuf(inbuf, arbuffer, inbc, off, aiu->length);
+				add = add_to_inbuf(src, &nsrc, arbuffer, inbc, off, 
+						   aiu->length);
 				inbc += add;
 				off += add;
 				nframes++;
@@ -486,8 +781,8 @@ static void writeout_audio(multiplex_t *mx, int type, int n)
 			case DUMMY_ERR:
 				length += aframesize;
 				if (aiu->fillframe){
-//					fprintf(stderr,"2. memcopy 0x%x\n",aiu->fillframe);
-					my_memcpy(inbuf, inbc, aiu->fillframe, aframesize, INSIZE);
+					add_to_iov(src, &nsrc, aiu->fillframe, 
+						   aframesize);
 					inbc += aframesize;
 					fakelength += aframesize;
 					nframes++;
@@ -521,37 +816,23 @@ static void writeout_audio(multiplex_t *mx, int type, int n)
 	}
 	nlength = length;
 
-/*
 	if (type == MPEG_AUDIO)
-		written = write_audio_pes( mx->pack_size, mx->apidn, mx->ac3n
-					   , n, pts, mx->SCR, mx->muxr, 
-					   outbuf, &nlength, PTS_ONLY,
-					   arbuffer);
+		niov = vwrite_audio_pes( mx->pack_size, &mx->atmpl[n], 
+					 pts, mx->SCR, outbuf, &nlength, 
+					 PTS_ONLY, src, nsrc, inbc, iov);
 	else 
-		written = write_ac3_pes( mx->pack_size, mx->apidn, mx->ac3n
-					 , n, pts, mx->SCR, mx->muxr, 
-					 outbuf, &nlength, PTS_ONLY,
-					 nframes, ac3_off,
-					 arbuffer, aiu->length);
-*/
-
-	if (type == MPEG_AUDIO)
-		written = bwrite_audio_pes( mx->pack_size, mx->apidn, mx->ac3n
-					   , n, pts, mx->SCR, mx->muxr, 
-					   outbuf, &nlength, PTS_ONLY,
-					   inbuf, inbc);
-	else 
-		written = bwrite_ac3_pes( mx->pack_size, mx->apidn, mx->ac3n
-					 , n, pts, mx->SCR, mx->muxr, 
-					 outbuf, &nlength, PTS_ONLY,
-					 nframes, ac3_off,
-					 inbuf, inbc , aiu->length);
+		niov = vwrite_ac3_pes( mx->pack_size, &mx->ac3tmpl[n], 
+				       0x80 + n + mx->apidn, pts, mx->SCR, 
+				       outbuf, &nlength, PTS_ONLY,
+				       nframes, ac3_off,
+				       src, nsrc, inbc, aiu->length, iov);
+	if (niov < 0) niov = 0;
 	
 	if (aiu->err == DUMMY_ERR){
 		fakelength -= length-nlength;
 	}
 	length -= nlength;
-	mplx_write(mx, outbuf, written);
+	mplx_writev(mx, iov, niov);
 	if (nlength-fakelength+droplength){
 		ring_skip(arbuffer, nlength-fakelength+droplength);
 	}
@@ -599,18 +880,194 @@ static void writeout_padding (multiplex_t *mx)
 	uint8_t outbuf[3000];
 	//fprintf(stderr,"writing PADDING pack\n");
 
-	write_padding_pes( mx->pack_size, mx->apidn, mx->ac3n, mx->SCR, 
-			   mx->muxr, outbuf);
+	write_padding_tmpl( mx->pack_size, &mx->vtmpl, mx->SCR, outbuf);
 	mplx_write(mx, outbuf, mx->pack_size);
 }
 
-void check_times( multiplex_t *mx, int *video_ok, int *audio_ok, int *ac3_ok,
-		  int *start)
+/* stream 0 is the video, then the MPEG audio and the AC3 streams, 
+   which can be written once their PTS is within their window of
+   the SCR */
+static uint64_t sched_time(multiplex_t *mx, int s)
+{
+	if (!s) return mx->viu.dts + mx->video_delay;
+	if (s <= N_AUDIO) return mx->apts[s-1];
+	return mx->ac3pts[s-1-N_AUDIO];
+}
+
+static uint64_t sched_window(int s)
+{
+	if (!s) return 1000*CLOCK_MS;
+	return 200*CLOCK_MS;
+}
+
+static int sched_due(multiplex_t *mx, int s)
+{
+	return ptscmp(sched_time(mx, s), sched_window(s) + mx->oldSCR) < 0;
+}
+
+// s becomes due before t
+static int sched_before(multiplex_t *mx, int s, int t)
+{
+	return ptscmp(sched_time(mx, s) + sched_window(t), 
+		      sched_time(mx, t) + sched_window(s)) < 0;
+}
+
+static void sched_push(multiplex_t *mx, int s)
 {
+	int *h = mx->sched_heap;
+	int c, p;
+
+	c = mx->sched_n++;
+	while (c){
+		p = (c-1)/2;
+		if (!sched_before(mx, s, h[p])) break;
+		h[c] = h[p];
+		c = p;
+	}
+	h[c] = s;
+}
+
+static int sched_pop(multiplex_t *mx)
+{
+	int *h = mx->sched_heap;
+	int top = h[0];
+	int s, c, n;
+	int p = 0;
+
+	n = --mx->sched_n;
+	s = h[n];
+	while ((c = 2*p+1) < n){
+		if (c+1 < n && sched_before(mx, h[c+1], h[c])) c++;
+		if (!sched_before(mx, h[c], s)) break;
+		h[p] = h[c];
+		p = c;
+	}
+	h[p] = s;
+	return top;
+}
+
+// all streams are checked until they are not due
+static void sched_init(multiplex_t *mx)
+{
+	mx->sched_n = 0;
+	mx->video_due = 1;
+	mx->audio_due = audio_mask(mx->apidn);
+	mx->ac3_due = audio_mask(mx->ac3n);
+}
+
+// the decoder buffers of waiting streams are only cleared when needed
+static void sched_sync(multiplex_t *mx)
+{
+	int i;
+
+	dummy_delete(&mx->vdbuf, mx->sched_SCR);
+	for (i = 0; i < mx->apidn; i++)
+		dummy_delete(&mx->adbuf[i], mx->sched_SCR);
+	for (i = 0; i < mx->ac3n; i++)
+		dummy_delete(&mx->ac3dbuf[i], mx->sched_SCR);
+}
+
+// SCR increments until ptscmp(t, base + k*SCRinc) < 0
+static uint64_t sched_steps(multiplex_t *mx, uint64_t t, uint64_t base)
+{
+	int64_t d = ptsdiff(t, base);
+
+	if (d < 0) return 0;
+	return d/mx->SCRinc + 1;
+}
+
+// when a due stream gets enough room in its decoder buffer
+static int sched_room(multiplex_t *mx, dummy_buffer *dbuf, uint32_t size,
+		      uint64_t *steps)
+{
+	uint64_t t, k;
+
+	if (dummy_room(dbuf, size, &t) < 0) return -1;
+	if (!(k = sched_steps(mx, t, mx->SCR))) return -1;
+	if (!*steps || k < *steps) *steps = k;
+	return 0;
+}
+
+// a stream still waits for its window or for room in its decoder buffer
+static int sched_waiting(multiplex_t *mx)
+{
+	uint64_t steps = 0;
+	uint32_t m;
 	int i;
+
+	if (mx->sched_n && !sched_due(mx, mx->sched_heap[0])) return 1;
+	if (mx->video_due && mx->viu.length && 
+	    index_avail(mx->index_vrbuffer) &&
+	    !sched_room(mx, &mx->vdbuf, mx->vsize, &steps))
+		return 1;
+	for (m = mx->audio_due; m; m &= m-1){
+		i = __builtin_ctz(m);
+		if (mx->aiu[i].length && 
+		    index_avail(&mx->index_arbuffer[i]) &&
+		    !sched_room(mx, &mx->adbuf[i], mx->asize, &steps))
+			return 1;
+	}
+	for (m = mx->ac3_due; m; m &= m-1){
+		i = __builtin_ctz(m);
+		if (mx->ac3iu[i].length && 
+		    index_avail(&mx->index_ac3rbuffer[i]) &&
+		    !sched_room(mx, &mx->ac3dbuf[i], mx->asize, &steps))
+			return 1;
+	}
+	return 0;
+}
+
+/* In VBR mode nothing is written while no stream can be delivered, so
+   the SCR moves on to the slot in which the next stream becomes due or
+   gets room in its decoder buffer. The slots stay the same as with one
+   increment per check_times. */
+static void sched_skip(multiplex_t *mx)
+{
+	uint64_t steps = 0;
+	uint32_t m;
+	int i, s;
+
+	if (mx->finish || mx->extra_clock > 0) return;
+
+	if (mx->sched_n){
+		s = mx->sched_heap[0];
+		// sched_due uses the SCR before the increment
+		steps = sched_steps(mx, sched_time(mx, s), 
+				    sched_window(s) + mx->SCR) + 1;
+	}
+
+	// streams waiting for data can't skip
+	if (mx->video_due){
+		if (!mx->viu.length || !index_avail(mx->index_vrbuffer) ||
+		    sched_room(mx, &mx->vdbuf, mx->vsize, &steps) < 0) 
+			return;
+	}
+	for (m = mx->audio_due; m; m &= m-1){
+		i = __builtin_ctz(m);
+		if (!mx->aiu[i].length || 
+		    !index_avail(&mx->index_arbuffer[i]) ||
+		    sched_room(mx, &mx->adbuf[i], mx->asize, &steps) < 0)
+			return;
+	}
+	for (m = mx->ac3_due; m; m &= m-1){
+		i = __builtin_ctz(m);
+		if (!mx->ac3iu[i].length || 
+		    !index_avail(&mx->index_ac3rbuffer[i]) ||
+		    sched_room(mx, &mx->ac3dbuf[i], mx->asize, &steps) < 0)
+			return;
+	}
+
+	if (steps > 1) ptsinc(&mx->SCR, (steps-1)*mx->SCRinc);
+}
+
+void check_times( multiplex_t *mx, int *video_ok, uint32_t *audio_ok, 
+		  uint32_t *ac3_ok, int *start)
+{
+	int i, s;
+	uint32_t m;
 	
-	memset(audio_ok, 0, N_AUDIO*sizeof(int));
-	memset(ac3_ok, 0, N_AC3*sizeof(int));
+	*audio_ok = 0;
+	*ac3_ok = 0;
 	*video_ok = 0;
 	
 	if (mx->fill_buffers(mx->priv, mx->finish)< 0) {
@@ -671,57 +1128,80 @@ void check_times( multiplex_t *mx, int *video_ok, int *audio_ok, int *ac3_ok,
 				mx->extra_clock = 0.0;
 		}
 	}
-
+	mx->sched_SCR = mx->SCR;
+
+	/* wake up the streams that are due */
+	while (mx->sched_n && sched_due(mx, mx->sched_heap[0])){
+		s = sched_pop(mx);
+		if (!s) mx->video_due = 1;
+		else if (s <= N_AUDIO) mx->audio_due |= 1U << (s-1);
+		else mx->ac3_due |= 1U << (s-1-N_AUDIO);
+	}
 
 	/* clear decoder buffers up to SCR */
-	dummy_delete(&mx->vdbuf, mx->SCR);    
+	if (mx->video_due) dummy_delete(&mx->vdbuf, mx->SCR);    
 	
-	for (i=0;i <mx->apidn; i++){
+	for (m = mx->audio_due; m; m &= m-1){
+		i = __builtin_ctz(m);
 		dummy_delete(&mx->adbuf[i], mx->SCR);
 		clear_audio(mx, MPEG_AUDIO, i);
 	}
-	for (i=0;i <mx->ac3n; i++) {
+	for (m = mx->ac3_due; m; m &= m-1){
+		i = __builtin_ctz(m);
 		dummy_delete(&mx->ac3dbuf[i], mx->SCR);
 		clear_audio(mx, AC3, i);
 	}
 	
-	
-	if (dummy_space(&mx->vdbuf) > mx->vsize && mx->viu.length > 0 &&
-	    (ptscmp(mx->viu.dts + mx->video_delay, 1000*CLOCK_MS +mx->oldSCR)<0)
-	    && ring_avail(mx->index_vrbuffer)){
-		*video_ok = 1;
+	/* streams that are not due any more wait in the heap */
+	if (mx->video_due){
+		if (!sched_due(mx, 0)){
+			mx->video_due = 0;
+			sched_push(mx, 0);
+		} else if (dummy_space(&mx->vdbuf) > mx->vsize && 
+			   mx->viu.length > 0 &&
+			   index_avail(mx->index_vrbuffer)){
+			*video_ok = 1;
+		}
 	}
 	
-	for (i = 0; i < mx->apidn; i++){
-		if (dummy_space(&mx->adbuf[i]) > mx->asize && 
-		    mx->aiu[i].length > 0 &&
-		    ptscmp(mx->apts[i], 200*CLOCK_MS + mx->oldSCR) < 0
-		    && ring_avail(&mx->index_arbuffer[i])){
-			audio_ok[i] = 1;
+	for (m = mx->audio_due; m; m &= m-1){
+		i = __builtin_ctz(m);
+		if (!sched_due(mx, 1+i)){
+			mx->audio_due &= ~(1U << i);
+			sched_push(mx, 1+i);
+		} else if (dummy_space(&mx->adbuf[i]) > mx->asize && 
+			   mx->aiu[i].length > 0 &&
+			   index_avail(&mx->index_arbuffer[i])){
+			*audio_ok |= 1U << i;
 		}
 	}
-	for (i = 0; i < mx->ac3n; i++){
-		if (dummy_space(&mx->ac3dbuf[i]) > mx->asize && 
-		    mx->ac3iu[i].length > 0 &&
-		    ptscmp(mx->ac3pts[i], 200*CLOCK_MS + mx->oldSCR) < 0
-		    && ring_avail(&mx->index_ac3rbuffer[i])){
-			ac3_ok[i] = 1;
+	for (m = mx->ac3_due; m; m &= m-1){
+		i = __builtin_ctz(m);
+		if (!sched_due(mx, 1+N_AUDIO+i)){
+			mx->ac3_due &= ~(1U << i);
+			sched_push(mx, 1+N_AUDIO+i);
+		} else if (dummy_space(&mx->ac3dbuf[i]) > mx->asize && 
+			   mx->ac3iu[i].length > 0 &&
+			   index_avail(&mx->index_ac3rbuffer[i])){
+			*ac3_ok |= 1U << i;
 		}
 	}
 }
 
 void write_out_packs( multiplex_t *mx, int video_ok, 
-		      int *audio_ok, int *ac3_ok)
+		      uint32_t audio_ok, uint32_t ac3_ok)
 {
 	int i;
+	uint32_t m;
 
 	if (video_ok && !all_audio_ok(audio_ok, mx->apidn) && 
 	    !all_audio_ok(ac3_ok, mx->ac3n)) {
 		writeout_video(mx);  
 	} else { // second case(s): audio ok, video in time
 		int done=0;
-		for ( i = 0; i < mx->ac3n; i++){
-			if ( ac3_ok[i] && !rest_audio_ok(i,ac3_ok, mx->ac3n)			    
+		for (m = ac3_ok; m; m &= m-1){
+			i = __builtin_ctz(m);
+			if (!rest_audio_ok(i,ac3_ok, mx->ac3n)
 			     && !all_audio_ok(audio_ok, mx->apidn)){
 
 				writeout_audio(mx, AC3, i);
@@ -730,9 +1210,9 @@ void write_out_packs( multiplex_t *mx, int video_ok,
 			}
 		}
 
-		for ( i = 0; i < mx->apidn && !done; i++){
-			if ( audio_ok[i] && !rest_audio_ok(i, audio_ok, 
-							   mx->apidn)){
+		for (m = audio_ok; m && !done; m &= m-1){
+			i = __builtin_ctz(m);
+			if (!rest_audio_ok(i, audio_ok, mx->apidn)){
 				writeout_audio(mx, MPEG_AUDIO, i);
 				done = 1;
 				break;
@@ -742,6 +1222,8 @@ void write_out_packs( multiplex_t *mx, int video_ok,
 
 		if (!done && !mx->VBR){
 			writeout_padding(mx);
+		} else if (!done && !video_ok && !audio_ok && !ac3_ok){
+			sched_skip(mx);
 		}
 	}
 	
@@ -751,54 +1233,58 @@ void finish_mpg(multiplex_t *mx)
 {
 	int start=0;
 	int video_ok = 0;
-	int audio_ok[N_AUDIO];
-	int ac3_ok[N_AC3];
+	uint32_t audio_ok = 0;
+	uint32_t ac3_ok = 0;
         int n,nn,old,i;
         uint8_t mpeg_end[4] = { 0x00, 0x00, 0x01, 0xB9 };
                                                                                 
-        memset(audio_ok, 0, N_AUDIO*sizeof(int));
-        memset(ac3_ok, 0, N_AC3*sizeof(int));
         mx->finish = 1;
                                                                                 
         old = 0;nn=0;
         while ((n=buffers_filled(mx)) && nn<20 ){
-                if (n== old) nn++;
+		// waiting for the window or for buffer room is no stall
+                if (n== old && !sched_waiting(mx)) nn++;
                 else if (nn) nn--;
                 old = n;
-                check_times( mx, &video_ok, audio_ok, ac3_ok, &start);
+                check_times( mx, &video_ok, &audio_ok, &ac3_ok, &start);
                 write_out_packs( mx, video_ok, audio_ok, ac3_ok);
         }
+	sched_sync(mx);
 
+// flush the rest, with the units the writers already hold,
+// every pack in its own SCR slot
+        mx->finish = 2;
         old = 0;nn=0;
-	while ((n=ring_avail(mx->index_vrbuffer)/sizeof(index_unit))
+	// a large frame takes many packs, its rest shows the progress
+	while ((n=index_avail(mx->index_vrbuffer) + mx->viu.length)
 	       && nn<10){
 		if (n== old) nn++;
 		else if (nn) nn--;
 		old = n;
+		ptsinc(&mx->SCR, mx->SCRinc);
 		writeout_video(mx);  
 	}
 	
-// flush the rest
-        mx->finish = 2;
         old = 0;nn=0;
 	for (i = 0; i < mx->apidn; i++){
-		while ((n=ring_avail(&mx->index_arbuffer[i])/sizeof(index_unit))
-		       && nn <10){
+		while ((n=index_left(&mx->index_arbuffer[i]) +
+			mx->aiu[i].length) && nn <10){
 			if (n== old) nn++;
 			else if (nn) nn--;
 			old = n;
+			ptsinc(&mx->SCR, mx->SCRinc);
 			writeout_audio(mx, MPEG_AUDIO, i);
 		}
 	}
 	
         old = 0;nn=0;
 	for (i = 0; i < mx->ac3n; i++){
-		while ((n=ring_avail(&mx->index_ac3rbuffer[i])
-			/sizeof(index_unit))
-			&& nn<10){
+		while ((n=index_left(&mx->index_ac3rbuffer[i]) +
+			mx->ac3iu[i].length) && nn<10){
 			if (n== old) nn++;
 			else if (nn) nn--;
 			old = n;
+			ptsinc(&mx->SCR, mx->SCRinc);
 			writeout_audio(mx, AC3, i);
 		}
 	}
@@ -806,6 +1292,19 @@ void finish_mpg(multiplex_t *mx)
                           
 	if (mx->otype == REPLEX_MPEG2)
 		mplx_write(mx, mpeg_end,4);
+	flush_mpg(mx);
+
+#ifdef OUT_DEBUG
+	fprintf(stderr,"Buffer peaks  video: %d/%d", dummy_peak(&mx->vdbuf),
+		mx->vdbuf.size);
+	for (i = 0; i < mx->apidn; i++)
+		fprintf(stderr,"  audio%d: %d/%d", i, dummy_peak(&mx->adbuf[i]),
+			mx->adbuf[i].size);
+	for (i = 0; i < mx->ac3n; i++)
+		fprintf(stderr,"  ac3%d: %d/%d", i, dummy_peak(&mx->ac3dbuf[i]),
+			mx->ac3dbuf[i].size);
+	fprintf(stderr,"\n");
+#endif
 }
 
 
@@ -827,9 +1326,23 @@ void init_multiplex( multiplex_t *mx, sequence_t *seq_head, audio_frame_t *afram
 	mx->fd_out = fd;
 	mx->otype = otype;
 	mx->total_written = 0;
+	mx->startSCR = 0;
 	mx->zero_write_count = 0;
 	mx->max_write = 0;
 	mx->max_reached = 0;
+	mx->obuf_len = 0;
+	mx->obuf_count = 0;
+	mx->direct = (fcntl(fd, F_GETFL) & O_DIRECT) ? 1 : 0;
+	if (posix_memalign((void **)&mx->obuf, OUT_ALIGN, OUT_BUF))
+		mx->obuf = NULL;
+	else {
+		static int exit_set = 0;
+
+		// fatal errors call exit(), the packs written so far are kept
+		if (!exit_set && !atexit(mplx_exit)) exit_set = 1;
+		exit_mx = mx;
+		exit_owner = pthread_self();
+	}
 
 	switch(mx->otype){
 
@@ -879,11 +1392,53 @@ void init_multiplex( multiplex_t *mx, sequence_t *seq_head, audio_frame_t *afram
 		mx->write_end_codes = 1;
 		mx->set_broken_link = 1;
 		break;
+
+	case REPLEX_MPEGTS:
+		mx->video_delay += 180*CLOCK_MS;
+		mx->audio_delay += 180*CLOCK_MS;
+		// the PES of a pack fills whole TS packets, one with PCR
+		mx->pack_size = PS_HEADER_L1 + TS_PES*(TS_SIZE-4) - 8;
+		mx->audio_buffer_size = 4*1024;
+		mx->video_buffer_size = 224*1024;
+		mx->mux_rate = 0;
+		mx->navpack = 0;
+		mx->frame_timestamps = TIME_ALWAYS;
+		mx->VBR = 1;
+		mx->reset_clocks = 1;
+		mx->write_end_codes = 1;
+		mx->set_broken_link = 1;
+		if (mx->ts_rate){
+			// room for PAT, PMT and PCR packets
+			int packs = (mx->ts_rate/(8*TS_SIZE) - TS_PSI_RATE)
+				/TS_PES;
+
+			if (packs < 1){
+				fprintf(stderr,"TS rate too low\n");
+				exit(1);
+			}
+			mx->mux_rate = packs*mx->pack_size;
+			mx->VBR = 0;
+		}
+		break;
 	}
 
 	mx->apidn = apidn;
 	mx->ac3n = ac3n;
 
+	if (mx->otype == REPLEX_MPEGTS){
+		ts_program *p = &mx->tsprog;
+
+		memset(p, 0, sizeof(ts_program));
+		p->number = 1;
+		p->pmt_pid = TS_PMT_PID;
+		p->pcr_pid = TS_VIDEO_PID;
+		p->vpid = TS_VIDEO_PID;
+		for (i = 0; i < apidn && i < MAX_PSTREAMS; i++)
+			p->apid[p->apidn++] = TS_AUDIO_PID+i;
+		for (i = 0; i < ac3n && i < MAX_PSTREAMS; i++)
+			p->ac3pid[p->ac3n++] = TS_AC3_PID+i;
+	}
+
 
 	mx->vrbuffer = vrbuffer;
 	mx->index_vrbuffer = index_vrbuffer;
@@ -916,12 +1471,25 @@ void init_multiplex( multiplex_t *mx, sequence_t *seq_head, audio_frame_t *afram
 	mx->muxr = (data_rate / 8 * mx->pack_size) / mx->data_size; 
                                      // muxrate of payload in Byte/s
 
+	// a constant TS rate has to carry the declared rates
+	if (mx->ts_rate && mx->mux_rate < mx->muxr){
+		uint32_t packs = (mx->muxr + mx->pack_size - 1)/mx->pack_size;
+
+		fprintf(stderr, "TS rate too low for the streams, "
+			"they need at least -C %d\n", (int)
+			(((uint64_t)packs*TS_PES + TS_PSI_RATE)*8*TS_SIZE + 999)
+			/1000);
+		exit(1);
+	}
 	if (mx->mux_rate) {
 		if ( mx->mux_rate < mx->muxr)
                         fprintf(stderr, "data rate may be to high for required mux rate\n");
                 mx->muxr = mx->mux_rate;
         }
 	fprintf(stderr, "Mux rate: %.2f Mbit/s\n", mx->muxr*8.0/1000000.);
+	if (mx->ts_rate)
+		fprintf(stderr, "TS rate: %.2f Mbit/s\n", 
+			mx->ts_rate/1000000.);
 	
 	mx->SCRinc = 27000000ULL/((uint64_t)mx->muxr / 
 				     (uint64_t) mx->pack_size);
@@ -947,7 +1515,17 @@ void setup_multiplex(multiplex_t *mx)
 
 	packlen = mx->pack_size;
 
-	mx->SCR = 0;
+	mx->SCR = mx->startSCR;
+	mx->sched_SCR = mx->SCR;
+	sched_init(mx);
+
+	init_pes_tmpl(&mx->vtmpl, 0xE0, mx->muxr, mx->apidn+mx->ac3n);
+	for (i=0; i < mx->apidn; i++)
+		init_pes_tmpl(&mx->atmpl[i], 0xC0+i, mx->muxr, 
+			      mx->apidn+mx->ac3n);
+	for (i=0; i < mx->ac3n; i++)
+		init_pes_tmpl(&mx->ac3tmpl[i], PRIVATE_STREAM1, mx->muxr, 
+			      mx->apidn+mx->ac3n);
 
 	// write first VOBU header
 	if (mx->navpack){
@@ -31,6 +31,7 @@
 #include "mpg_common.h"
 #include "pes.h"
 #include "element.h"
+#include "ts.h"
 
 #define N_AUDIO 32
 #define N_AC3 8
@@ -41,6 +42,7 @@ typedef struct multiplex_s{
 #define REPLEX_MPEG2  0
 #define REPLEX_DVD    1
 #define REPLEX_HDTV   2
+#define REPLEX_MPEGTS 3
 	int otype;
 	int startup;
 	int finish;
@@ -71,6 +73,7 @@ typedef struct multiplex_s{
 	uint64_t SCR;
 	uint64_t oldSCR;
 	uint64_t SCRinc;
+	uint64_t startSCR;
 	index_unit viu;
 	index_unit aiu[N_AUDIO];
 	index_unit ac3iu[N_AC3];
@@ -85,6 +88,30 @@ typedef struct multiplex_s{
 	int max_write;
 	int max_reached;
 
+// batched output
+#define OUT_BUF   (1024*1024)
+#define OUT_ALIGN 4096
+	uint8_t *obuf;
+	int obuf_len;
+	int obuf_count;
+	int direct;
+
+// TS output
+	uint32_t ts_rate;   // bit/s, 0 for VBR without null packets
+	ts_program tsprog;
+	uint8_t pat_cc;
+	uint8_t pmt_cc;
+	uint8_t vcc;
+	uint8_t acc[N_AUDIO];
+	uint8_t ac3cc[N_AC3];
+	uint8_t null_cc;
+	int ts_started;
+	uint64_t ts_start;
+	uint64_t ts_count;
+	uint64_t ts_clock;
+	uint64_t last_pcr;
+	uint64_t last_psi;
+
 /* needed from replex */
 	int apidn;
 	int ac3n;
@@ -93,6 +120,20 @@ typedef struct multiplex_s{
 	dummy_buffer adbuf[N_AUDIO];
 	dummy_buffer ac3dbuf[N_AC3];
 
+// scheduler: streams wait in a heap until their PTS is close enough
+#define N_STREAMS (1+N_AUDIO+N_AC3)
+	int sched_heap[N_STREAMS];
+	int sched_n;
+	int video_due;
+	uint32_t audio_due;
+	uint32_t ac3_due;
+	uint64_t sched_SCR;
+
+// pack and PES headers, built once the mux rate is known
+	pes_tmpl vtmpl;
+	pes_tmpl atmpl[N_AUDIO];
+	pes_tmpl ac3tmpl[N_AC3];
+
 	ringbuffer *ac3rbuffer;
 	ringbuffer *index_ac3rbuffer;
 	ringbuffer *arbuffer;
@@ -104,11 +145,13 @@ typedef struct multiplex_s{
 	void *priv;
 } multiplex_t;
 
-void check_times( multiplex_t *mx, int *video_ok, int *audio_ok, int *ac3_ok,
-		  int *start);
+void check_times( multiplex_t *mx, int *video_ok, uint32_t *audio_ok, 
+		  uint32_t *ac3_ok, int *start);
 void write_out_packs( multiplex_t *mx, int video_ok, 
-		      int *audio_ok, int *ac3_ok);
+		      uint32_t audio_ok, uint32_t ac3_ok);
 void finish_mpg(multiplex_t *mx);
+void flush_mpg(multiplex_t *mx);
+int set_direct_io(int fd);
 void init_multiplex( multiplex_t *mx, sequence_t *seq_head, audio_frame_t *aframe,
 		     audio_frame_t *ac3frame, int apidn, int ac3n,	
 		     uint64_t video_delay, uint64_t audio_delay, int fd,
@@ -156,6 +156,50 @@ void init_pes_in(pes_in_t *p, int t, ringbuffer *rb, int wi){
 }
 
 
+/* a complete audio or video PES header at the start of buf is taken
+   in one go, anything else is left to the state machine in get_pes */
+static int get_pes_header(pes_in_t *p, uint8_t *buf, int count)
+{
+	uint8_t *hb;
+	int hl;
+	int plength;
+
+	if (count < 9 || buf[0] || buf[1] || buf[2] != 0x01) return 0;
+	switch (buf[3]){
+	case PRIVATE_STREAM1:
+	case VIDEO_STREAM_S ... VIDEO_STREAM_E:
+	case AUDIO_STREAM_S ... AUDIO_STREAM_E:
+		break;
+	default:
+		return 0;
+	}
+	if ((buf[6] & 0xC0) != 0x80) return 0;
+
+	hl = buf[8]+9;
+	plength = (buf[4] << 8) | buf[5];
+	if (count < hl || (plength && plength+6 <= hl)) return 0;
+	if (!p->withbuf && hl > sizeof(p->hbuf)) return 0;
+	if ((buf[7] & PTS_ONLY) && hl < 14) return 0;
+	if ((buf[7] & PTS_DTS) == PTS_DTS && hl < 19) return 0;
+
+	p->cid = buf[3];
+	p->plen[0] = buf[4];
+	p->plen[1] = buf[5];
+	p->plength = plength;
+	p->flag1 = buf[6];
+	p->flag2 = buf[7];
+	p->hlength = buf[8];
+	p->mpeg = 2;
+	if (p->flag2 & PTS_ONLY) memcpy(p->pts, buf+9, 5);
+	if ((p->flag2 & PTS_DTS) == PTS_DTS) memcpy(p->dts, buf+14, 5);
+
+	hb = p->withbuf ? p->buf : p->hbuf;
+	memcpy(hb, buf, hl);
+	p->found = hl;
+
+	return hl;
+}
+
 void get_pes (pes_in_t *p, uint8_t *buf, int count, void (*func)(pes_in_t *p))
 {
 
@@ -164,6 +208,10 @@ void get_pes (pes_in_t *p, uint8_t *buf, int count, void (*func)(pes_in_t *p))
 	int c=0;
 
 	uint8_t headr[3] = { 0x00, 0x00, 0x01} ;
+
+	if (!p->found && !p->done)
+		c = get_pes_header(p, buf, count);
+
 	while (c < count && (!p->mpeg ||
 			     (p->mpeg == 2 && p->found < 9))
 	       &&  (p->found < 5 || !p->done)){
@@ -497,6 +545,34 @@ int cwrite_ps(uint8_t *buf, ps_packet *p, uint32_t length)
 
 
 
+// the 32 bit SCR base and the extension of a pack header
+static inline void put_scr(uint8_t *p, uint64_t SCR)
+{
+	uint32_t v = (uint32_t)(SCR/300ULL);
+	uint32_t ext = (uint32_t)(SCR%300ULL);
+
+	p[0] = 0x44 | ((v >> 27)&0x18) | ((v >> 28)&0x03);
+	p[1] = (uint8_t)(v >> 20);
+	p[2] = 0x04 | ((v >> 12)&0xF8) | ((v >> 13)&0x03);
+	p[3] = (uint8_t)(v >> 5);
+	p[4] = 0x04 | ((v << 3)&0xF8) | ((ext >> 7)&0x03);
+	p[5] = 0x01 | ((ext << 1)&0xFF);
+}
+
+/* PTS or DTS of a PES header, bit 32 of the base is kept in the top 
+   bit of the first byte */
+static inline void put_pts(uint8_t *p, uint64_t PTS)
+{
+	uint64_t t = PTS/300ULL;
+	uint32_t v = (uint32_t)t;
+
+	p[0] = 0x21 | ((v >> 29)&0x06) | ((t >> 25)&0x80);
+	p[1] = (uint8_t)(v >> 22);
+	p[2] = 0x01 | ((v >> 14)&0xFE);
+	p[3] = (uint8_t)(v >> 7);
+	p[4] = 0x01 | ((v << 1)&0xFE);
+}
+
 int write_ps_header(uint8_t *buf, 
 		    uint64_t   SCR, 
 		    uint32_t   muxr,
@@ -509,32 +585,9 @@ int write_ps_header(uint8_t *buf,
 		    uint8_t    navpack)
 {
 	ps_packet p;
-	uint8_t *scr;
-	uint32_t lscr;
-	uint16_t scr_ext = 0;
 
 	init_ps(&p);
-	
-	lscr = htonl((uint32_t) ((SCR/300ULL) & 0x00000000FFFFFFFF));
-	scr = (uint8_t *) &lscr;
-	scr_ext = (uint16_t) ((SCR%300ULL) & 0x00000000000001FF);
-	
-// SCR = 0
-	p.scr[0] = 0x44;
-	p.scr[1] = 0x00;
-	p.scr[2] = 0x04;
-	p.scr[3] = 0x00;
-	p.scr[4] = 0x04;
-	p.scr[5] = 0x01;
-	
-	p.scr[0] = 0x44 | ((scr[0] >> 3)&0x18) | ((scr[0] >> 4)&0x03);
-	p.scr[1] = 0x00 | ((scr[0] << 4)&0xF0) | ((scr[1] >> 4)&0x0F);
-	p.scr[2] = 0x04 | ((scr[1] << 4)&0xF0) | ((scr[2] >> 4)&0x08)
-		| ((scr[2] >> 5)&0x03);
-	p.scr[3] = 0x00 | ((scr[2] << 3)&0xF8) | ((scr[3] >> 5)&0x07);
-	p.scr[4] = 0x04 | ((scr[3] << 3)&0xF8) | ((scr_ext >> 7)&0x03);
-	p.scr[5] = 0x01 | ((scr_ext << 1)&0xFF);
-
+	put_scr(p.scr, SCR);
 	
 	muxr = muxr/50;
 	p.mux_rate[0] = (uint8_t)(muxr >> 14);
@@ -582,43 +635,18 @@ int write_ps_header(uint8_t *buf,
 }
 
 
-void get_pespts(uint8_t *spts,uint8_t *pts)
-{
-
-        pts[0] = 0x21 |
-                ((spts[0] & 0xC0) >>5);
-        pts[1] = ((spts[0] & 0x3F) << 2) |
-                ((spts[1] & 0xC0) >> 6);
-        pts[2] = 0x01 | ((spts[1] & 0x3F) << 2) |
-                ((spts[2] & 0x80) >> 6);
-        pts[3] = ((spts[2] & 0x7F) << 1) |
-                ((spts[3] & 0x80) >> 7);
-        pts[4] = 0x01 | ((spts[3] & 0x7F) << 1);
-}
-
 int write_pes_header(uint8_t id, int length , uint64_t PTS, uint64_t DTS, 
 		     uint8_t *obuf, int stuffing, uint8_t ptsdts)
 {
 	uint8_t le[2];
 	uint8_t dummy[3];
-	uint8_t *pts;
 	uint8_t ppts[5];
-	uint32_t lpts;
-	uint8_t *dts;
 	uint8_t pdts[5];
-	uint32_t ldts;
 	int c;
 	uint8_t headr[3] = {0x00, 0x00, 0x01};
 	
-	lpts = htonl((PTS/300ULL) & 0x00000000FFFFFFFFULL);
-	pts = (uint8_t *) &lpts;
-	get_pespts(pts,ppts);
-	if ((PTS/300ULL) & 0x0000000100000000ULL) ppts[0] |= 0x80;
-
-	ldts = htonl((DTS/300ULL) & 0x00000000FFFFFFFFULL);
-	dts = (uint8_t *) &ldts;
-	get_pespts(dts,pdts);
-	if ((DTS/300ULL) & 0x0000000100000000ULL) pdts[0] |= 0x80;
+	put_pts(ppts, PTS);
+	put_pts(pdts, DTS);
 
 	c = 0;
 	memcpy(obuf+c,headr,3);
@@ -671,29 +699,90 @@ int write_pes_header(uint8_t id, int length , uint64_t PTS, uint64_t DTS,
 	return c;
 }
 
-void write_padding_pes( int pack_size, int apidn, int ac3n, 
-			uint64_t SCR, uint64_t muxr, uint8_t *buf)
+void init_pes_tmpl(pes_tmpl *t, uint8_t id, uint32_t muxr, 
+		   uint8_t audio_bound)
 {
-	int pos = 0;
+	uint8_t *p = t->head+PS_HEADER_L1;
+
+	write_ps_header(t->head, 0, muxr, audio_bound, 0, 0, 1, 1, 1, 0);
+	p[0] = 0x00;
+	p[1] = 0x00;
+	p[2] = 0x01;
+	p[3] = id;
+	p[4] = 0;
+	p[5] = 0;
+	p[6] = 0x80;
+	p[7] = 0;
+	p[8] = 0;
+}
+
+/* pack and PES header from the template, length counts the whole
+   PES packet like in write_pes_header */
+int write_pes_tmpl(uint8_t *buf, pes_tmpl *t, uint64_t SCR, int length, 
+		   uint64_t PTS, uint64_t DTS, int stuffing, uint8_t ptsdts)
+{
+	uint8_t *p = buf+PS_HEADER_L1;
+	int c = PS_HEADER_L1+PES_H_MIN;
 
-	pos = write_ps_header(buf,SCR,muxr, apidn+ ac3n, 0, 0, 1, 1, 1,
-			      0);
+	memcpy(buf, t->head, c);
+	put_scr(buf+4, SCR);
+	length -= 6;
+	p[4] = (uint8_t)(length >> 8);
+	p[5] = (uint8_t)length;
 
-	pos += write_pes_header( PADDING_STREAM, pack_size-pos, 0, 0, buf+pos,
-				 0, 0);
+	if (ptsdts == PTS_ONLY){
+		p[7] = PTS_ONLY;
+		p[8] = 5 + stuffing;
+	} else if (ptsdts == PTS_DTS){
+		p[7] = PTS_DTS;
+		p[8] = 10 + stuffing;
+	}
 
+	memset(buf+c, 0xFF, stuffing);
+	c += stuffing;
+
+	if (ptsdts == PTS_ONLY || ptsdts == PTS_DTS){
+		put_pts(buf+c, PTS);
+		c += 5;
+	}
+	if (ptsdts == PTS_DTS){
+		put_pts(buf+c, DTS);
+		c += 5;
+	}
+	return c;
+}
+
+void write_padding_tmpl(int pack_size, pes_tmpl *t, uint64_t SCR, 
+			uint8_t *buf)
+{
+	memcpy(buf, t->head, PS_HEADER_L1);
+	put_scr(buf+4, SCR);
+	write_pes_header( PADDING_STREAM, pack_size-PS_HEADER_L1, 0, 0, 
+			  buf+PS_HEADER_L1, 0, 0);
+}
+
+void write_padding_pes( int pack_size, int apidn, int ac3n, 
+			uint64_t SCR, uint64_t muxr, uint8_t *buf)
+{
+	pes_tmpl t;
+
+	init_pes_tmpl(&t, PADDING_STREAM, muxr, apidn+ac3n);
+	write_padding_tmpl(pack_size, &t, SCR, buf);
 }
 
-int write_video_pes( int pack_size, int apidn, int ac3n, uint64_t vpts, 
-		     uint64_t vdts, uint64_t SCR, uint64_t muxr, 
-		     uint8_t *buf, int *vlength, 
-		     uint8_t ptsdts, ringbuffer *vrbuffer)
+/* iov gets the headers in buf, the payload in the ring and the
+   padding, the caller skips *vlength bytes once the pack is written */
+int vwrite_video_pes( int pack_size, pes_tmpl *t, uint64_t vpts, 
+		      uint64_t vdts, uint64_t SCR, 
+		      uint8_t *buf, int *vlength, 
+		      uint8_t ptsdts, ringbuffer *vrbuffer, struct iovec *iov)
 {
 	int add;
 	int pos = 0;
 	int p   = 0;
 	int stuff = 0;
 	int length = *vlength;
+	int k, niov = 0;
 
 #ifdef PES_DEBUG
 	fprintf(stderr,"write video PES ");
@@ -719,158 +808,59 @@ int write_video_pes( int pack_size, int apidn, int ac3n, uint64_t vpts,
 			length = length+p;
 	}
 
-	pos = write_ps_header(buf,SCR,muxr, apidn+ac3n, 0, 0, 1, 1, 
-			      1, 0);
-
-	pos += write_pes_header( 0xE0, length-pos, vpts, vdts, buf+pos, 
-				 stuff, ptsdts);
+	pos = write_pes_tmpl(buf, t, SCR, length-PS_HEADER_L1, vpts, vdts, 
+			     stuff, ptsdts);
 	if (length-pos > *vlength){
 		fprintf(stderr,"WHAT THE HELL  %d > %d\n", length-pos,
 			*vlength);
 	}
+	iov[niov].iov_base = buf;
+	iov[niov++].iov_len = pos;
 
-	add = ring_read( vrbuffer, buf+pos, length-pos);
+	add = length-pos;
+	if ((k = ring_iov(vrbuffer, iov+niov, add, 0)) < 0) return -1;
+	niov += k;
 	*vlength = add;
-	if (add < 0) return -1;
-	pos += add;
-
-	if (pos+PES_MIN < pack_size){
-		pos += write_pes_header( PADDING_STREAM, pack_size-pos, 0, 0,
-					 buf+pos, 0, 0);
-		pos = pack_size;
-	}		
-	return pos;
-}
-
-int write_audio_pes(  int pack_size, int apidn, int ac3n, int n, uint64_t pts, 
-		      uint64_t SCR, uint32_t muxr, uint8_t *buf, int *alength, 
-		      uint8_t ptsdts, 	ringbuffer *arbuffer)
-{
-	int add;
-	int pos = 0;
-	int p   = 0;
-	int stuff = 0;
-	int length = *alength;
-
-#ifdef PES_DEBUG
-	fprintf(stderr,"write audio PES ");
-	printpts(pts);
-	fprintf(stderr,"\n");
-#endif
-
-	if (!length) return 0;
-	p = PS_HEADER_L1+PES_H_MIN;
-
-	if (ptsdts == PTS_ONLY){
-		p += 5;
-	}
-
-	if ( length+p >= pack_size){
-		length = pack_size;
-	} else {
-		if (pack_size-length-p <= PES_MIN){
-			stuff = pack_size - length-p;
-			length = pack_size;
-		} else 
-			length = length+p;
-	}
-	pos = write_ps_header(buf,SCR,muxr, apidn + ac3n, 0, 0, 1, 1, 
-			      1, 0);
-	pos += write_pes_header( 0xC0+n, length-pos, pts, 0, buf+pos, stuff, 
-				 ptsdts);
-	add = ring_read( arbuffer, buf+pos, length-pos);
-	*alength = add;
-	if (add < 0) return -1;
 	pos += add;
 
 	if (pos+PES_MIN < pack_size){
-		pos += write_pes_header( PADDING_STREAM, pack_size-pos, 0,0,
-					 buf+pos, 0, 0);
-		pos = pack_size;
+		iov[niov].iov_base = buf+iov[0].iov_len;
+		iov[niov].iov_len = write_pes_header( PADDING_STREAM, 
+						      pack_size-pos, 0, 0,
+						      iov[niov].iov_base,
+						      0, 0);
+		niov++;
 	}		
-	if (pos != pack_size) {
-		fprintf(stderr,"apos: %d\n",pos);
-		exit(1);
-	}
-
-	return pos;
+	return niov;
 }
 
-
-
-int write_ac3_pes(  int pack_size, int apidn, int ac3n, int n,
-		    uint64_t pts, uint64_t SCR, 
-		    uint32_t muxr, uint8_t *buf, int *alength, uint8_t ptsdts,
-		    int nframes,int ac3_off, ringbuffer *ac3rbuffer, int framelength)
+// the first length bytes of src
+static int iov_head(struct iovec *iov, struct iovec *src, int nsrc, int length)
 {
-	int add;
-	int pos = 0;
-	int p   = 0;
-	int stuff = 0;
-	int length = *alength;
-
-#ifdef PES_DEBUG
-	fprintf(stderr,"write ac3 PES ");
-	printpts(pts);
-	fprintf(stderr,"\n");
-#endif
-
-	if (!length) return 0;
-	p = PS_HEADER_L1+PES_H_MIN;
+	int i, n = 0;
 
-	if (ptsdts == PTS_ONLY){
-		p += 5;
-	}
-
-	if ( length+p >= pack_size){
-		if (length+p -pack_size == framelength-4) nframes--;
-		length = pack_size;
-	} else {
-		if (pack_size-length-p <= PES_MIN){
-			stuff = pack_size - length-p;
-			length = pack_size;
-		} else 
-			length = length+p;
-	}
-	pos = write_ps_header(buf,SCR,muxr, apidn+ac3n, 0, 0, 1, 1, 
-			      1, 0);
-
-	pos += write_pes_header( PRIVATE_STREAM1, length-pos, pts, 0, 
-				 buf+pos, stuff, ptsdts);
-	buf[pos] = 0x80 + n +apidn;
-	buf[pos+1] = nframes;
-	buf[pos+2] = (ac3_off >> 8)& 0xFF;
-	buf[pos+3] = (ac3_off)& 0xFF;
-	pos += 4;
-
-	add = ring_read( ac3rbuffer, buf+pos, length-pos);
-	*alength = add;
-	if (add < 0) return -1;
-	pos += add;
-
-	if (pos+PES_MIN < pack_size){
-		pos += write_pes_header( PADDING_STREAM, pack_size-pos, 0,0,
-					 buf+pos, 0, 0);
-		pos = pack_size;
-	}		
-	if (pos != pack_size) {
-		fprintf(stderr,"apos: %d\n",pos);
-		exit(1);
+	for (i = 0; i < nsrc && length > 0; i++, n++){
+		iov[n].iov_base = src[i].iov_base;
+		iov[n].iov_len = src[i].iov_len;
+		if (iov[n].iov_len > length) iov[n].iov_len = length;
+		length -= iov[n].iov_len;
 	}
-
-	return pos;
+	return n;
 }
 
-
-int bwrite_audio_pes(  int pack_size, int apidn, int ac3n, int n, uint64_t pts, 
-		      uint64_t SCR, uint32_t muxr, uint8_t *buf, int *alength, 
-		       uint8_t ptsdts, uint8_t *arbuffer, int bsize )
+/* an audio pack from the frames in src, which holds bsize bytes, iov
+   gets the headers in buf, the frames and the padding */
+int vwrite_audio_pes(  int pack_size, pes_tmpl *t, uint64_t pts, 
+		       uint64_t SCR, uint8_t *buf, int *alength, 
+		       uint8_t ptsdts, struct iovec *src, int nsrc, int bsize,
+		       struct iovec *iov)
 {
 	int add;
 	int pos = 0;
 	int p   = 0;
 	int stuff = 0;
 	int length = *alength;
+	int niov = 0;
 
 #ifdef PES_DEBUG
 	fprintf(stderr,"write audio PES ");
@@ -894,22 +884,26 @@ int bwrite_audio_pes(  int pack_size, int apidn, int ac3n, int n, uint64_t pts,
 		} else 
 			length = length+p;
 	}
-	pos = write_ps_header(buf,SCR,muxr, apidn + ac3n, 0, 0, 1, 1, 
-			      1, 0);
-	pos += write_pes_header( 0xC0+n, length-pos, pts, 0, buf+pos, stuff, 
-				 ptsdts);
+	pos = write_pes_tmpl(buf, t, SCR, length-PS_HEADER_L1, pts, 0, stuff,
+			     ptsdts);
+	iov[niov].iov_base = buf;
+	iov[niov++].iov_len = pos;
 
-	if (length -pos < bsize){
-		memcpy(buf+pos, arbuffer, length-pos);
+	if (length -pos <= bsize){
 		add = length - pos;
+		niov += iov_head(iov+niov, src, nsrc, add);
 		*alength = add;
 	} else  return -1;
 	
 	pos += add;
 
 	if (pos+PES_MIN < pack_size){
-		pos += write_pes_header( PADDING_STREAM, pack_size-pos, 0,0,
-					 buf+pos, 0, 0);
+		iov[niov].iov_base = buf+iov[0].iov_len;
+		iov[niov].iov_len = write_pes_header( PADDING_STREAM, 
+						      pack_size-pos, 0,0,
+						      iov[niov].iov_base,
+						      0, 0);
+		niov++;
 		pos = pack_size;
 	}		
 	if (pos != pack_size) {
@@ -917,21 +911,21 @@ int bwrite_audio_pes(  int pack_size, int apidn, int ac3n, int n, uint64_t pts,
 		exit(1);
 	}
 
-	return pos;
+	return niov;
 }
 
-
-
-int bwrite_ac3_pes(  int pack_size, int apidn, int ac3n, int n,
-		    uint64_t pts, uint64_t SCR, 
-		    uint32_t muxr, uint8_t *buf, int *alength, uint8_t ptsdts,
-		     int nframes,int ac3_off, uint8_t *ac3rbuffer, int bsize, int framelength)
+int vwrite_ac3_pes(  int pack_size, pes_tmpl *t, uint8_t sub_id,
+		     uint64_t pts, uint64_t SCR, 
+		     uint8_t *buf, int *alength, uint8_t ptsdts,
+		     int nframes,int ac3_off, struct iovec *src, int nsrc, 
+		     int bsize, int framelength, struct iovec *iov)
 {
 	int add;
 	int pos = 0;
 	int p   = 0;
 	int stuff = 0;
 	int length = *alength;
+	int niov = 0;
 
 #ifdef PES_DEBUG
 	fprintf(stderr,"write ac3 PES ");
@@ -939,14 +933,15 @@ int bwrite_ac3_pes(  int pack_size, int apidn, int ac3n, int n,
 	fprintf(stderr,"\n");
 #endif
 	if (!length) return 0;
-	p = PS_HEADER_L1+PES_H_MIN;
+	// with the 4 bytes of sub id, frame count and first access unit
+	p = PS_HEADER_L1+PES_H_MIN+4;
 
 	if (ptsdts == PTS_ONLY){
 		p += 5;
 	}
 
 	if ( length+p >= pack_size){
-		if (length+p -pack_size == framelength-4) nframes--;
+		if (length+p -pack_size == framelength) nframes--;
 		length = pack_size;
 	} else {
 		if (pack_size-length-p <= PES_MIN){
@@ -955,27 +950,30 @@ int bwrite_ac3_pes(  int pack_size, int apidn, int ac3n, int n,
 		} else 
 			length = length+p;
 	}
-	pos = write_ps_header(buf,SCR,muxr, apidn+ac3n, 0, 0, 1, 1, 
-			      1, 0);
-
-	pos += write_pes_header( PRIVATE_STREAM1, length-pos, pts, 0, 
-				 buf+pos, stuff, ptsdts);
-	buf[pos] = 0x80 + n +apidn;
+	pos = write_pes_tmpl(buf, t, SCR, length-PS_HEADER_L1, pts, 0, stuff,
+			     ptsdts);
+	buf[pos] = sub_id;
 	buf[pos+1] = nframes;
 	buf[pos+2] = (ac3_off >> 8)& 0xFF;
 	buf[pos+3] = (ac3_off)& 0xFF;
 	pos += 4;
+	iov[niov].iov_base = buf;
+	iov[niov++].iov_len = pos;
 
 	if (length-pos <= bsize){
-		memcpy(buf+pos, ac3rbuffer, length-pos);
 		add = length-pos;
+		niov += iov_head(iov+niov, src, nsrc, add);
 		*alength = add;
 	} else return -1;
 	pos += add;
 
 	if (pos+PES_MIN < pack_size){
-		pos += write_pes_header( PADDING_STREAM, pack_size-pos, 0,0,
-					 buf+pos, 0, 0);
+		iov[niov].iov_base = buf+iov[0].iov_len;
+		iov[niov].iov_len = write_pes_header( PADDING_STREAM, 
+						      pack_size-pos, 0,0,
+						      iov[niov].iov_base,
+						      0, 0);
+		niov++;
 		pos = pack_size;
 	}		
 	if (pos != pack_size) {
@@ -983,7 +981,7 @@ int bwrite_ac3_pes(  int pack_size, int apidn, int ac3n, int n,
 		exit(1);
 	}
 
-	return pos;
+	return niov;
 }
 
 
@@ -90,6 +90,12 @@ struct ps_packet_{
 	int npes;
 } ps_packet;
 
+/* pack header and PES header start of one stream, only the SCR, 
+   the length and the PTS/DTS are filled in for each pack */
+typedef
+struct pes_tmpl_s{
+	uint8_t head[PS_HEADER_L1+PES_H_MIN];
+} pes_tmpl;
 
 typedef
 struct pes_in_s{
@@ -125,26 +131,31 @@ int ptscmp(uint64_t pts1, uint64_t pts2);
 uint64_t ptsadd(uint64_t pts1, uint64_t pts2);
 
 
+int write_ps_header(uint8_t *buf, uint64_t SCR, uint32_t muxr,
+		    uint8_t audio_bound, uint8_t fixed, uint8_t CSPS,
+		    uint8_t audio_lock, uint8_t video_lock,
+		    uint8_t video_bound, uint8_t navpack);
 void write_padding_pes( int pack_size, int apidn, int ac3n, 
 			uint64_t SCR, uint64_t muxr, uint8_t *buf);
-int write_ac3_pes(  int pack_size, int apidn, int ac3n, int n, uint64_t pts, 
-		    uint64_t SCR, 
-		    uint32_t muxr, uint8_t *buf, int *alength, uint8_t ptsdts,
-		    int nframes,int ac3_off, ringbuffer *ac3rbuffer, int framelength);
-int bwrite_ac3_pes(  int pack_size, int apidn, int ac3n, int n, uint64_t pts, 
-		    uint64_t SCR, 
-		    uint32_t muxr, uint8_t *buf, int *alength, uint8_t ptsdts,
-		     int nframes,int ac3_off, uint8_t *ac3rbuffer, int bsize, int framelength);
-int write_audio_pes(  int pack_size, int apidn, int ac3n, int n, uint64_t pts, 
-		      uint64_t SCR, uint32_t muxr, uint8_t *buf, int *alength, 
-		      uint8_t ptsdts, 	ringbuffer *arbuffer);
-int bwrite_audio_pes(  int pack_size, int apidn, int ac3n, int n, uint64_t pts, 
-		      uint64_t SCR, uint32_t muxr, uint8_t *buf, int *alength, 
-		       uint8_t ptsdts, uint8_t *arbuffer, int bsize );
-int write_video_pes( int pack_size, int apidn, int ac3n, uint64_t vpts, 
-		     uint64_t vdts, uint64_t SCR, uint64_t muxr, 
-		     uint8_t *buf, int *vlength, 
-		     uint8_t ptsdts, ringbuffer *vrbuffer);
+void init_pes_tmpl(pes_tmpl *t, uint8_t id, uint32_t muxr, 
+		   uint8_t audio_bound);
+int write_pes_tmpl(uint8_t *buf, pes_tmpl *t, uint64_t SCR, int length, 
+		   uint64_t PTS, uint64_t DTS, int stuffing, uint8_t ptsdts);
+void write_padding_tmpl(int pack_size, pes_tmpl *t, uint64_t SCR, 
+			uint8_t *buf);
+int vwrite_video_pes( int pack_size, pes_tmpl *t, uint64_t vpts, 
+		      uint64_t vdts, uint64_t SCR, 
+		      uint8_t *buf, int *vlength, 
+		      uint8_t ptsdts, ringbuffer *vrbuffer, struct iovec *iov);
+int vwrite_audio_pes(  int pack_size, pes_tmpl *t, uint64_t pts, 
+		       uint64_t SCR, uint8_t *buf, int *alength, 
+		       uint8_t ptsdts, struct iovec *src, int nsrc, int bsize,
+		       struct iovec *iov);
+int vwrite_ac3_pes(  int pack_size, pes_tmpl *t, uint8_t sub_id,
+		     uint64_t pts, uint64_t SCR, 
+		     uint8_t *buf, int *alength, uint8_t ptsdts,
+		     int nframes,int ac3_off, struct iovec *src, int nsrc, 
+		     int bsize, int framelength, struct iovec *iov);
 int write_nav_pack(int pack_size, int apidn, int ac3n, uint64_t SCR, uint32_t muxr, 
 		   uint8_t *buf);
 
@@ -0,0 +1,237 @@
+/*
+ * reader.c: read ahead and memory mapped input for replex
+ *
+ *
+ * Copyright (C) 2003 - 2006
+ *                    Marcus Metzler <mocm [at] mocm.de>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * General Public License for more details.
+ *
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ * Or, point your browser to http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "reader.h"
+
+static ssize_t read_block(int fd, uint8_t *buf, size_t count)
+{
+	ssize_t neof = 1;
+	size_t re = 0;
+
+	while(re < count){
+		neof = read(fd, buf+re, count - re);
+		if (neof > 0) re += neof;
+		else if (neof < 0 && errno == EINTR) continue;
+		else break;
+	}
+	if (neof < 0 && re == 0) return neof;
+	return re;
+}
+
+static void *reader_thread(void *p)
+{
+	reader_t *r = (reader_t *)p;
+	ssize_t re;
+	int b;
+
+	for(;;){
+		pthread_mutex_lock(&r->lock);
+		while (r->filled == r->nblocks && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->stop){
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		b = r->wblock;
+		pthread_mutex_unlock(&r->lock);
+
+		// the block at wblock is not visible to the consumer yet
+		re = read_block(r->fd, r->mem + b*r->bsize, r->bsize);
+
+		pthread_mutex_lock(&r->lock);
+		if (re < 0){
+			r->err = errno;
+			r->len[b] = 0;
+		} else r->len[b] = re;
+		r->wblock = (b+1) % r->nblocks;
+		r->filled++;
+		if (re < r->bsize) r->eof = 1;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		if (r->eof) break;
+	}
+
+	return NULL;
+}
+
+int reader_start(reader_t *r, int fd, int nblocks, int bsize)
+{
+	void *mem;
+
+	memset(r, 0, sizeof(reader_t));
+	if (nblocks < 2) nblocks = 2;
+	if (bsize < READ_ALIGN) bsize = READ_ALIGN;
+	bsize -= bsize % READ_ALIGN;
+
+	if (posix_memalign(&mem, READ_ALIGN, (size_t)nblocks*bsize)){
+		fprintf(stderr,"Not enough memory for read ahead\n");
+		return -1;
+	}
+	if (!(r->len = malloc(nblocks*sizeof(int)))){
+		free(mem);
+		fprintf(stderr,"Not enough memory for read ahead\n");
+		return -1;
+	}
+	r->mem = mem;
+	r->fd = fd;
+	r->nblocks = nblocks;
+	r->bsize = bsize;
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (pthread_create(&r->thread, NULL, reader_thread, r)){
+		fprintf(stderr,"Can't start read ahead thread\n");
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->lock);
+		free(r->len);
+		free(r->mem);
+		return -1;
+	}
+	r->running = 1;
+
+	return 0;
+}
+
+void reader_stop(reader_t *r)
+{
+	if (!r->running) return;
+
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r->len);
+	free(r->mem);
+	r->running = 0;
+}
+
+/* same semantics as a read() loop: returns count unless the
+   end of the input was reached */
+ssize_t reader_read(reader_t *r, uint8_t *buf, size_t count)
+{
+	size_t re = 0;
+	int b, l;
+
+	while (re < count){
+		pthread_mutex_lock(&r->lock);
+		while (!r->filled && !r->eof)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (!r->filled){
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		b = r->rblock;
+		pthread_mutex_unlock(&r->lock);
+
+		l = r->len[b] - r->roff;
+		if (l > count - re) l = count - re;
+		memcpy(buf+re, r->mem + b*r->bsize + r->roff, l);
+		re += l;
+		r->roff += l;
+
+		if (r->roff == r->len[b]){
+			pthread_mutex_lock(&r->lock);
+			r->rblock = (b+1) % r->nblocks;
+			r->roff = 0;
+			r->filled--;
+			pthread_cond_broadcast(&r->cond);
+			pthread_mutex_unlock(&r->lock);
+		}
+	}
+
+	if (!re && r->err){
+		errno = r->err;
+		return -1;
+	}
+	return re;
+}
+
+int map_start(inmap_t *m, int fd, uint64_t pos, uint64_t length)
+{
+	memset(m, 0, sizeof(inmap_t));
+	if (!length) return -1;
+
+	m->fd = fd;
+	m->pos = pos;
+	m->length = length;
+	m->running = 1;
+
+	return 0;
+}
+
+void map_stop(inmap_t *m)
+{
+	if (!m->running) return;
+	if (m->map) munmap(m->map, m->mlen);
+	m->map = NULL;
+	m->running = 0;
+}
+
+/* returns a pointer to the next count bytes of the file, which
+   stays valid until the next call */
+ssize_t map_get(inmap_t *m, uint8_t **ptr, size_t count)
+{
+	uint64_t l;
+	long psize;
+
+	if (m->pos >= m->length) return 0;
+	if (count > m->length - m->pos) count = m->length - m->pos;
+
+	if (!m->map || m->pos < m->moff || 
+	    m->pos + count > m->moff + m->mlen){
+		void *map;
+
+		psize = sysconf(_SC_PAGESIZE);
+		if (m->map) munmap(m->map, m->mlen);
+		m->map = NULL;
+		m->moff = m->pos - (m->pos % psize);
+		l = m->length - m->moff;
+		if (l > MAP_WINDOW) l = MAP_WINDOW;
+		if (count > l - (m->pos - m->moff)) 
+			l = m->pos - m->moff + count;
+		map = mmap(NULL, l, PROT_READ, MAP_SHARED, m->fd, m->moff);
+		if (map == MAP_FAILED) return -1;
+		madvise(map, l, MADV_SEQUENTIAL);
+		m->map = map;
+		m->mlen = l;
+	}
+
+	*ptr = m->map + (m->pos - m->moff);
+	m->pos += count;
+
+	return count;
+}
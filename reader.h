@@ -0,0 +1,81 @@
+/*
+ * reader.h
+ *
+ *
+ * Copyright (C) 2003 - 2006
+ *                    Marcus Metzler <mocm [at] mocm.de>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * General Public License for more details.
+ *
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ * Or, point your browser to http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+#ifndef _READER_H_
+#define _READER_H_
+
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define READ_BLOCK   (1024*1024)
+#define READ_ALIGN   4096
+
+/* input read ahead: a thread keeps nblocks blocks of the input
+   file in flight while the demuxer works on the completed ones */
+typedef struct reader_s {
+	int fd;
+	int nblocks;
+	int bsize;
+	uint8_t *mem;
+	int *len;
+	int rblock;
+	int roff;
+	int wblock;
+	int filled;
+	int eof;
+	int err;
+	int stop;
+	int running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} reader_t;
+
+int reader_start(reader_t *r, int fd, int nblocks, int bsize);
+void reader_stop(reader_t *r);
+ssize_t reader_read(reader_t *r, uint8_t *buf, size_t count);
+
+#define MAP_WINDOW   (32*1024*1024)
+
+/* memory mapped input: the file is mapped in sliding windows
+   and the data is handed out as pointers into the page cache */
+typedef struct inmap_s {
+	int fd;
+	uint64_t length;
+	uint64_t pos;
+	uint8_t *map;
+	uint64_t moff;
+	size_t mlen;
+	int running;
+} inmap_t;
+
+int map_start(inmap_t *m, int fd, uint64_t pos, uint64_t length);
+void map_stop(inmap_t *m);
+ssize_t map_get(inmap_t *m, uint8_t **ptr, size_t count);
+
+#endif /*_READER_H_*/
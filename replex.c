@@ -41,18 +41,28 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <errno.h>
 
 #include "replex.h"
 #include "pes.h"
 
 static int replex_all_set(struct replex *rx);
 
+static pthread_mutex_t overflow_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void overflow_exit(struct replex *rx)
 {
-	rx->overflows++;
+	int overflows;
+
+	// the audio streams may be analyzed in parallel
+	pthread_mutex_lock(&overflow_lock);
+	overflows = ++rx->overflows;
+	pthread_mutex_unlock(&overflow_lock);
 
 	if (rx->max_overflows && 
-	    rx->overflows > rx->max_overflows){
+	    overflows > rx->max_overflows){
 		fprintf(stderr,"exiting after %d overflows  last video PTS: ", rx->overflows);
 		printpts(rx->last_vpts);
 		fprintf(stderr,"\n");
@@ -60,22 +70,24 @@ void overflow_exit(struct replex *rx)
 	}
 }
 
-int replex_check_id(struct replex *rx, uint16_t id)
+static void pid_set(struct replex *rx, uint16_t pid, pes_in_t *p)
 {
-	int i;
+	// a PID given twice goes to the first stream, 0 is the PAT
+	if (pid && pid < N_PIDS && !rx->pid_pes[pid])
+		rx->pid_pes[pid] = p;
+}
 
-	if (id==rx->vpid)
-		return 0;
+// PID -> stream for the TS demuxer, one load per packet
+static void pid_table(struct replex *rx)
+{
+	int i;
 
+	memset(rx->pid_pes, 0, sizeof(rx->pid_pes));
+	pid_set(rx, rx->vpid, &rx->pvideo);
 	for (i=0; i<rx->apidn; i++)
-		if (id==rx->apid[i])
-			return i+1;
-
+		pid_set(rx, rx->apid[i], &rx->paudio[i]);
 	for (i=0; i<rx->ac3n; i++)
-		if (id==rx->ac3_id[i])
-			return i+0x80;
-
-	return -1;
+		pid_set(rx, rx->ac3_id[i], &rx->pac3[i]);
 }
 
 
@@ -166,25 +178,122 @@ static void create_fillframe2(ringbuffer *rbuf, int off, int *fsize,
 }
 
 
+/* a part of a split file ends with the units before the first frames
+   of the next part, the rest of the overlap is dropped */
+static int seg_video_end(struct replex *rx, index_unit *iu)
+{
+	sequence_t *s = &rx->seq_head;
+
+	if (!rx->seg_cut) return 0;
+	if (!rx->seg_vdone && iu->seq_header && iu->frame == I_FRAME &&
+	    ptscmp((iu->pts + rx->first_vpts + SEC_PER/2) % MAX_PTS2,
+		   rx->seg_end.vpts) >= 0)
+		rx->seg_vdone = 1;
+	return rx->seg_vdone;
+}
+
+// Adler-32 of the bytes of an audio unit, 0 if they are not in the ring
+static uint32_t seg_frame_sum(ringbuffer *rbuf, index_unit *iu)
+{
+	uint8_t buf[SEG_FRAME];
+	uint32_t a = 1, b = 0;
+	int i;
+
+	if (iu->err != NO_ERR || iu->length > SEG_FRAME ||
+	    ring_peek(rbuf, buf, iu->length, ring_rdiff(rbuf, iu->start)) < 0)
+		return 0;
+	for (i = 0; i < iu->length; i++){
+		a = (a + buf[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+/* the audio of a part ends with the frame before the first frame of
+   the next part, counted in frames from the first frame PTS of this
+   part, and the frame at the cut has to be the one the next part
+   starts with */
+static int seg_audio_end(struct replex *rx, int type, int n, index_unit *iu,
+			 uint64_t fpts, audio_frame_t *aframe, ringbuffer *rbuf)
+{
+	uint64_t end;
+	uint32_t sum, s;
+	int *done;
+
+	if (!rx->seg_cut) return 0;
+	if (type == AC3){
+		end = rx->seg_end.ac3pts[n];
+		sum = rx->seg_end.ac3sum[n];
+		done = &rx->seg_ac3done[n];
+	} else {
+		end = rx->seg_end.apts[n];
+		sum = rx->seg_end.asum[n];
+		done = &rx->seg_adone[n];
+	}
+	if (*done || cfix_audio_count(aframe, iu->pts, 0) < 
+	    cfix_audio_count(aframe, end, fpts))
+		return *done;
+
+	*done = 1;
+	if (sum && (s = seg_frame_sum(rbuf, iu)) && s != sum){
+		fprintf(stderr,"Part %d: %s stream %d does not end at the "
+			"first frame of the next part\n", rx->segment,
+			type == AC3 ? "AC3" : "audio", n);
+		rx->seg_err = 1;
+	}
+	return 1;
+}
+
+// all streams of the part reached the next one
+static int seg_done(struct replex *rx)
+{
+	int i;
+
+	if (!rx->seg_cut || !rx->seg_vdone) return 0;
+	for (i = 0; i < rx->apidn; i++)
+		if (!rx->seg_adone[i]) return 0;
+	for (i = 0; i < rx->ac3n; i++)
+		if (!rx->seg_ac3done[i]) return 0;
+	return 1;
+}
+
+// a part that did not reach the next one fails
+static int seg_failed(struct replex *rx)
+{
+	if (rx->seg_cut && !seg_done(rx)){
+		fprintf(stderr,"Part %d ends before the next part starts\n",
+			rx->segment);
+		return 1;
+	}
+	return rx->seg_err;
+}
+
 static void fill_in_frames(ringbuffer *index_buf, int fc, audio_frame_t *aframe, 
 			   uint64_t *acount, uint8_t *fillframe, int fsize, struct replex *rx)
 {								
 	index_unit iu;
 	int f;
 
-	for (f=0; f < fc; f++){
+	// one unit for up to MAX_REPEAT+1 frames, expanded when read
+	while (fc > 0){
+		f = fc > MAX_REPEAT ? MAX_REPEAT+1 : fc;
 		init_index(&iu);
 		iu.active = 1;
 		iu.pts = add_pts_audio(0, aframe,*acount);
+		iu.dts = *acount;
+		iu.layer = aframe->layer;
+		iu.frequency = aframe->frequency;
+		iu.repeat = f-1;
 		iu.framesize = fsize;
 		iu.length = fsize;
 		iu.fillframe = fillframe;
 		iu.err = DUMMY_ERR;
-		if (ring_write(index_buf, (uint8_t *)&iu, sizeof(index_unit)) < 0){
+		if (index_write(index_buf, &iu) < 0){
 			fprintf(stderr,"audio ring buffer overrun error\n");
 			overflow_exit(rx);
 		}
-		*acount += 1;
+		*acount += f;
+		fc -= f;
 	}
 }
 
@@ -194,7 +303,7 @@ static int analyze_audio_loop( pes_in_t *p, struct replex *rx, int type,
 			       uint64_t *acount, uint64_t *fpts, 
 			       uint64_t *lpts, int bsize, int *apes_abort,
 			       uint64_t *ajump, uint64_t *aoff,
-			       uint64_t adelay, int n, int off,
+			       uint64_t adelay, int n, int *off,
 			       int c, int len, int pos, int *first, int *filled)
 {
 	int re=0;
@@ -212,12 +321,12 @@ static int analyze_audio_loop( pes_in_t *p, struct replex *rx, int type,
 		switch( type ){
 		case AC3:
 			re = get_ac3_info(rbuf, aframe, 
-					  pos+c+off,
+					  pos+c+*off,
 					  len-c-pos,1);
 			break;
 		case MPEG_AUDIO:
 			re = get_audio_info(rbuf, aframe, 
-					    pos+c+off,
+					    pos+c+*off,
 					    len-c-pos, 1);
 			break;
 		}
@@ -236,18 +345,22 @@ static int analyze_audio_loop( pes_in_t *p, struct replex *rx, int type,
 				fprintf(stderr,"\n");
 			} else {
 				aframe->set = 0;
-				ring_skip(rbuf,pos+c+off+re);
+				ring_skip(rbuf,pos+c+*off+re);
 			}
 		}
 		
-		if (aframe->set && *first)
+		/* the first frame need not be at the start of the PES, the
+		   offsets of the rest of the PES move with the skip */
+		if (aframe->set && *first){
 			ring_skip(rbuf,pos+c);
+			*off -= pos+c;
+		}
 	} else {
 		int diff = ring_posdiff(rbuf, iu->start, 
 					p->ini_pos + pos+c);
 		
 		if ( (re =check_audio_header(rbuf, aframe, 
-					     pos+c+off,len-c-pos,
+					     pos+c+*off,len-c-pos,
 					     type)) < 0){
 			
 			if ( re == -2){
@@ -298,7 +411,8 @@ static int analyze_audio_loop( pes_in_t *p, struct replex *rx, int type,
 				*acount -= 1;
 			}
 			
-			if (ring_write(index_buf, (uint8_t *)iu, sizeof(index_unit)) < 0){
+			if (!seg_audio_end(rx, type, n, iu, *fpts, aframe, rbuf) &&
+			    index_write(index_buf, iu) < 0){
 				fprintf(stderr,"audio ring buffer overrun error\n");
 				overflow_exit(rx);
 			}
@@ -559,7 +673,7 @@ void analyze_audio( pes_in_t *p, struct replex *rx, int len, int num, int type)
 			c = analyze_audio_loop( p, rx, type, aframe, iu, 
 						rbuf, index_buf, acount, fpts, 
 						lpts, bsize, apes_abort,
-						ajump, aoff, adelay, num, off,
+						ajump, aoff, adelay, num, &off,
 						c, len, pos, &first, filled);
 		} else {
 			*apes_abort = len-c;
@@ -572,6 +686,7 @@ void analyze_audio( pes_in_t *p, struct replex *rx, int len, int num, int type)
 void analyze_video( pes_in_t *p, struct replex *rx, int len)
 {
 	uint8_t buf[8];
+	uint8_t *hb;
 	int c=0;
 	int pos=0;
 	uint8_t head;
@@ -594,6 +709,7 @@ void analyze_video( pes_in_t *p, struct replex *rx, int len)
 	int seq_p = 0;
 	int flush=0;
 	int keep_now = 0;
+	sc_table_t sct;
 
 	rbuf = &rx->vrbuffer;
 	index_buf = &rx->index_vrbuffer;
@@ -609,8 +725,9 @@ void analyze_video( pes_in_t *p, struct replex *rx, int len)
 
 	
 //	fprintf(stderr, "len %d  %d\n",len,off);
+	sc_table_init(&sct, rbuf, off, len);
 	while (c < len){
-		if ((pos = ring_find_any_header( rbuf, &head, c+off, len-c)) 
+		if ((pos = sc_table_find(&sct, rbuf, &head, c, off, len)) 
 		    >=0 ){
 			switch(head){
 			case SEQUENCE_HDR_CODE:
@@ -820,15 +937,15 @@ void analyze_video( pes_in_t *p, struct replex *rx, int len)
 				gop = 1;
 				gop_off = c+pos - seq_p;
 				
-				if (ring_peek(rbuf, buf, 7, off+c+pos) < 0){
+				if (!(hb = ring_peek_ptr(rbuf, buf, 7, off+c+pos))){
 					rx->vpes_abort = len -(c+pos-1);
 					return;
 				}				
-				hour = (int)((buf[4]>>2)& 0x1F);
-				min  = (int)(((buf[4]<<4)& 0x30)| 
-					     ((buf[5]>>4)& 0x0F));
-				sec  = (int)(((buf[5]<<3)& 0x38)|
-					     ((buf[6]>>5)& 0x07));
+				hour = (int)((hb[4]>>2)& 0x1F);
+				min  = (int)(((hb[4]<<4)& 0x30)| 
+					     ((hb[5]>>4)& 0x0F));
+				sec  = (int)(((hb[5]<<3)& 0x38)|
+					     ((hb[6]>>5)& 0x07));
 #ifdef IN_DEBUG
 				fprintf(stderr,	" gop %02d:%02d.%02d %d\n",
 					hour,min,sec, 
@@ -845,11 +962,11 @@ void analyze_video( pes_in_t *p, struct replex *rx, int len)
 					return;
 				}
 				
-				if (ring_peek(rbuf, buf, 6, off+c+pos) < 0) 
+				if (!(hb = ring_peek_ptr(rbuf, buf, 6, off+c+pos))) 
 					return;
 
 
-				frame = ((buf[5]&0x38) >>3);
+				frame = ((hb[5]&0x38) >>3);
 				
 				if (frame == I_FRAME){
 					if( !rx->first_iframe){
@@ -867,8 +984,8 @@ void analyze_video( pes_in_t *p, struct replex *rx, int len)
 				if (s->set){
 					if (!seq_h && !gop) flush = 1;
 				}
-				tempref = (buf[5]>>6) & 0x03;
-				tempref |= buf[4] << 2;
+				tempref = (hb[5]>>6) & 0x03;
+				tempref |= hb[4] << 2;
 
 				switch (frame){
 				case I_FRAME:
@@ -921,9 +1038,9 @@ void analyze_video( pes_in_t *p, struct replex *rx, int len)
 								  p->ini_pos+
 								  pos+c-frame_off);
 
-					if ( ring_write(index_buf, (uint8_t *)
-							 &rx->current_vindex,
-							 sizeof(index_unit))<0){
+					if (!seg_video_end(rx, iu) &&
+					    index_write(index_buf, 
+							&rx->current_vindex) < 0){
 						fprintf(stderr,"video ring buffer overrun error 1\n");
 						overflow_exit(rx);
 
@@ -1053,7 +1170,8 @@ void pes_es_out(pes_in_t *p)
 
 	switch(p->cid){
 	case VIDEO_STREAM_S ... VIDEO_STREAM_E:
-		if (rx->vpid != p->cid) break;
+		// nothing is kept after the end of a part
+		if (rx->vpid != p->cid || rx->seg_vdone) break;
 		p->type = 0xE0;
 		p->ini_pos = ring_wpos(&rx->vrbuffer);
 
@@ -1078,7 +1196,7 @@ void pes_es_out(pes_in_t *p)
 		for (i=0; i<rx->apidn; i++)
 			if (p->cid == rx->apid[i])
 				l = i;
-		if (l < 0) break;
+		if (l < 0 || rx->seg_adone[l]) break;
 		p->ini_pos = ring_wpos(&rx->arbuffer[l]);
 		if (ring_write(&rx->arbuffer[l], p->buf+9+p->hlength, len)<0){
 			fprintf(stderr,"audio ring buffer overrun error\n");
@@ -1119,6 +1237,7 @@ void pes_es_out(pes_in_t *p)
 					l = i;
 			if (l < 0) break;
 		}
+		if (rx->seg_ac3done[l]) break;
 		len -= hl;
 		p->ini_pos = ring_wpos(&rx->ac3rbuffer[l]);
 	
@@ -1218,36 +1337,10 @@ void avi_es_out(pes_in_t *p)
 }
 
 
-int replex_tsp(struct replex *rx, uint8_t *tsp)
+static int replex_tsp_pes(pes_in_t *p, uint8_t *tsp)
 {
-	uint16_t pid;
-	int type;
 	int off=0;
-	pes_in_t *p=NULL;
-
-	pid = get_pid(tsp+1);
-
-	if ((type=replex_check_id(rx, pid))<0)
-		return 0;
-	
-	switch(type){
-	case 0:
-		p = &rx->pvideo;
-		break;
 
-	case 1 ... 32:
-		p = &rx->paudio[type-1];
-		break;
-
-	case 0x80 ... 0x87:
-		p = &rx->pac3[type-0x80];
-		break;
-	default:
-		return 0;
-		
-	}
-
-	
 	if ( tsp[1] & PAY_START){
 		if (p->plength == MMAX_PLENGTH-6){
 			p->plength = p->found-6;
@@ -1266,23 +1359,195 @@ int replex_tsp(struct replex *rx, uint8_t *tsp)
 	return 0;
 }
 
+int replex_tsp(struct replex *rx, uint8_t *tsp)
+{
+	pes_in_t *p;
 
-ssize_t save_read(struct replex *rx, void *buf, size_t count)
+	if (!(p = rx->pid_pes[get_pid(tsp+1)]))
+		return 0;
+	return replex_tsp_pes(p, tsp);
+}
+
+#define IN_SIZE (1000*TS_SIZE)
+
+/* first pass over a block: checks the sync bytes, counts errored and
+   scrambled packets and keeps only the packets of our streams, the
+   block starts with a sync byte and packets may be 188, 192 or 204
+   bytes apart */
+static int ts_classify(struct replex *rx, uint8_t *buf, int len)
 {
-	ssize_t neof = 1;
-	size_t re = 0;
-	int fd = rx->fd_in;
+	ts_batch *b = &rx->batch;
+	int j;
 
-	if (rx->itype== REPLEX_AVI){
-		int l = rx->inflength - rx->finread;
-		if ( l <= 0) return 0;
-		if ( count > l) count = l;
+	if (!b->pkt){
+		int n = IN_SIZE/TS_SIZE+1;
+
+		if (!(b->pkt = malloc(n*sizeof(uint8_t *))) ||
+		    !(b->pes = malloc(n*sizeof(pes_in_t *)))){
+			fprintf(stderr,"Not enough memory for TS demux\n");
+			exit(1);
+		}
 	}
-	while(neof >= 0 && re < count){
-		neof = read(fd, buf+re, count - re);
-		if (neof > 0) re += neof;
-		else break;
+
+	b->n = 0;
+	for (j = 0; j + TS_SIZE <= len; j += rx->ts_stride){
+		uint8_t *tsp = buf+j;
+		pes_in_t *p;
+
+		b->packets++;
+		if (tsp[0] != 0x47){
+			b->sync_err++;
+			continue;
+		}
+		if (tsp[1] & TRANS_ERROR) b->trans_err++;
+		if (tsp[3] & (TRANS_SCRMBL1|TRANS_SCRMBL2)) b->scrambled++;
+		if (!(p = rx->pid_pes[get_pid(tsp+1)])) continue;
+		b->pkt[b->n] = tsp;
+		b->pes[b->n++] = p;
+	}
+
+	return b->n;
+}
+
+static void *worker_thread(void *p)
+{
+	replex_worker *w = (replex_worker *)p;
+	replex_workers *ws = w->ws;
+	int i;
+
+	for(;;){
+		pthread_mutex_lock(&ws->lock);
+		while (w->gen == ws->gen && !ws->stop)
+			pthread_cond_wait(&ws->cond, &ws->lock);
+		if (ws->stop){
+			pthread_mutex_unlock(&ws->lock);
+			break;
+		}
+		w->gen = ws->gen;
+		pthread_mutex_unlock(&ws->lock);
+
+		for (i = 0; i < w->npkt; i++)
+			replex_tsp(w->rx, w->pkt[i]);
+
+		pthread_mutex_lock(&ws->lock);
+		ws->pending--;
+		if (!ws->pending) pthread_cond_signal(&ws->done);
+		pthread_mutex_unlock(&ws->lock);
+	}
+
+	return NULL;
+}
+
+static void workers_stop(struct replex *rx)
+{
+	replex_workers *ws = rx->workers;
+	int i;
+
+	if (!ws) return;
+
+	pthread_mutex_lock(&ws->lock);
+	ws->stop = 1;
+	pthread_cond_broadcast(&ws->cond);
+	pthread_mutex_unlock(&ws->lock);
+	for (i = 0; i < ws->nworkers; i++)
+		pthread_join(ws->w[i].thread, NULL);
+
+	for (i = 0; i < N_AUDIO+N_AC3; i++) free(ws->w[i].pkt);
+	free(ws->vpkt);
+	pthread_cond_destroy(&ws->done);
+	pthread_cond_destroy(&ws->cond);
+	pthread_mutex_destroy(&ws->lock);
+	free(ws);
+	rx->workers = NULL;
+}
+
+static int workers_start(struct replex *rx)
+{
+	replex_workers *ws;
+	int i;
+	int n = IN_SIZE/TS_SIZE+1;
+
+	if (!(ws = calloc(1, sizeof(replex_workers)))){
+		fprintf(stderr,"Not enough memory for analysis threads\n");
+		return -1;
+	}
+	pthread_mutex_init(&ws->lock, NULL);
+	pthread_cond_init(&ws->cond, NULL);
+	pthread_cond_init(&ws->done, NULL);
+	rx->workers = ws;
+
+	if (!(ws->vpkt = malloc(n*sizeof(uint8_t *)))){
+		fprintf(stderr,"Not enough memory for analysis threads\n");
+		workers_stop(rx);
+		return -1;
 	}
+	for (i = 0; i < rx->apidn + rx->ac3n; i++){
+		replex_worker *w = &ws->w[i];
+
+		w->rx = rx;
+		w->ws = ws;
+		if (!(w->pkt = malloc(n*sizeof(uint8_t *)))){
+			fprintf(stderr,"Not enough memory for analysis threads\n");
+			workers_stop(rx);
+			return -1;
+		}
+		if (pthread_create(&w->thread, NULL, worker_thread, w)){
+			fprintf(stderr,"Can't start analysis thread\n");
+			workers_stop(rx);
+			return -1;
+		}
+		ws->nworkers++;
+	}
+	fprintf(stderr,"Analyzing %d audio streams in separate threads\n",
+		ws->nworkers);
+
+	return 0;
+}
+
+// sorts the packets by stream and waits until all streams are done
+static void workers_tsp(struct replex *rx, uint8_t *buf, int len)
+{
+	replex_workers *ws = rx->workers;
+	ts_batch *b = &rx->batch;
+	int i, n;
+
+	ws->nvpkt = 0;
+	for (i = 0; i < ws->nworkers; i++) ws->w[i].npkt = 0;
+
+	n = ts_classify(rx, buf, len);
+	for (i = 0; i < n; i++){
+		pes_in_t *p = b->pes[i];
+		replex_worker *w;
+
+		if (p == &rx->pvideo){
+			ws->vpkt[ws->nvpkt++] = b->pkt[i];
+			continue;
+		}
+		if (p >= rx->paudio && p < rx->paudio+N_AUDIO)
+			w = &ws->w[p - rx->paudio];
+		else
+			w = &ws->w[rx->apidn + (p - rx->pac3)];
+		w->pkt[w->npkt++] = b->pkt[i];
+	}
+
+	pthread_mutex_lock(&ws->lock);
+	ws->pending = ws->nworkers;
+	ws->gen++;
+	pthread_cond_broadcast(&ws->cond);
+	pthread_mutex_unlock(&ws->lock);
+
+	for (i = 0; i < ws->nvpkt; i++)
+		replex_tsp(rx, ws->vpkt[i]);
+
+	pthread_mutex_lock(&ws->lock);
+	while (ws->pending)
+		pthread_cond_wait(&ws->done, &ws->lock);
+	pthread_mutex_unlock(&ws->lock);
+}
+
+
+static void read_progress(struct replex *rx, size_t re)
+{
 	rx->finread += re;
 #ifndef OUT_DEBUG
 	if (rx->inflength){
@@ -1294,6 +1559,11 @@ ssize_t save_read(struct replex *rx, void *buf, size_t count)
 			rx->lastper = per;
 		}
 		if (rx->finread >= rx->inflength && rx->inputFiles && rx->inputFiles[rx->inputIdx + 1]) {
+			int ahead = rx->reader.running;
+			int mapped = rx->inmap.running;
+
+			reader_stop(&rx->reader);
+			map_stop(&rx->inmap);
 			close(rx->fd_in);
 			rx->inputIdx ++;
 			if ((rx->fd_in = open(rx->inputFiles[rx->inputIdx] ,O_RDONLY| O_LARGEFILE)) < 0) {
@@ -1306,14 +1576,58 @@ ssize_t save_read(struct replex *rx, void *buf, size_t count)
 			lseek(rx->fd_in,0,SEEK_SET);
 			rx->lastper = 0;
 			rx->finread = 0;
+			if (ahead && reader_start(&rx->reader, rx->fd_in,
+						  rx->read_ahead, READ_BLOCK) < 0)
+				exit(1);
+			if (mapped)
+				map_start(&rx->inmap, rx->fd_in, 0, rx->inflength);
 		}
 	} else fprintf(stderr,"read %.2f MB\r", rx->finread/1024./1024.);
 #endif
+}
+
+ssize_t save_read(struct replex *rx, void *buf, size_t count)
+{
+	ssize_t neof = 1;
+	size_t re = 0;
+	int fd = rx->fd_in;
+
+	// a part of a split TS ends at inflength or its last frame
+	if (seg_done(rx)) return 0;
+	if (rx->itype== REPLEX_AVI || rx->segment){
+		int l = rx->inflength - rx->finread;
+		if ( l <= 0) return 0;
+		if ( count > l) count = l;
+	}
+	if (rx->reader.running){
+		neof = reader_read(&rx->reader, buf, count);
+		if (neof > 0) re = neof;
+	} else while(neof >= 0 && re < count){
+		neof = read(fd, buf+re, count - re);
+		if (neof > 0) re += neof;
+		else break;
+	}
+	read_progress(rx, re);
 	if (neof < 0 && re == 0) return neof;
 	else return re;
 }
 
-int guess_fill( struct replex *rx)
+// like save_read, but returns a pointer into the mapped file
+static ssize_t save_map(struct replex *rx, uint8_t **buf, size_t count)
+{
+	ssize_t re;
+
+	if (seg_done(rx)) return 0;
+	if ((re = map_get(&rx->inmap, buf, count)) > 0)
+		read_progress(rx, re);
+	return re;
+}
+
+
+static int fill_size(int apidn, int ac3n,
+		     ringbuffer *vrbuffer, ringbuffer *index_vrbuffer,
+		     ringbuffer *arbuffer, ringbuffer *index_arbuffer,
+		     ringbuffer *ac3rbuffer, ringbuffer *index_ac3rbuffer)
 {
 	int vavail, aavail, ac3avail, i, fill;
 
@@ -1323,22 +1637,20 @@ int guess_fill( struct replex *rx)
 	fill =0;
 	
 #define LIMIT 3
-	if ((vavail = ring_avail(&rx->index_vrbuffer)/sizeof(index_unit))
+	if ((vavail = index_avail(index_vrbuffer))
 	    < LIMIT) 
-		fill = ring_free(&rx->vrbuffer);
+		fill = ring_free(vrbuffer);
 	
-	for (i=0; i<rx->apidn;i++){
-		if ((aavail = ring_avail(&rx->index_arbuffer[i])
-		     /sizeof(index_unit)) < LIMIT)
-			if (fill < ring_free(&rx->arbuffer[i]))
-				fill = ring_free(&rx->arbuffer[i]);
+	for (i=0; i<apidn;i++){
+		if ((aavail = index_avail(&index_arbuffer[i])) < LIMIT)
+			if (fill < ring_free(&arbuffer[i]))
+				fill = ring_free(&arbuffer[i]);
 	}
 
-	for (i=0; i<rx->ac3n;i++){
-		if ((ac3avail = ring_avail(&rx->index_ac3rbuffer[i])
-		     /sizeof(index_unit)) < LIMIT)
-			if (fill < ring_free(&rx->ac3rbuffer[i]))
-				fill = ring_free(&rx->ac3rbuffer[i]);
+	for (i=0; i<ac3n;i++){
+		if ((ac3avail = index_avail(&index_ac3rbuffer[i])) < LIMIT)
+			if (fill < ring_free(&ac3rbuffer[i]))
+				fill = ring_free(&ac3rbuffer[i]);
 	}
 
 //	fprintf(stderr,"free %d  %d %d %d\n",fill, vavail, aavail, ac3avail);
@@ -1351,12 +1663,75 @@ int guess_fill( struct replex *rx)
 	return fill/2;
 }
 
+int guess_fill( struct replex *rx)
+{
+	return fill_size(rx->apidn, rx->ac3n, 
+			 &rx->vrbuffer, &rx->index_vrbuffer,
+			 rx->arbuffer, rx->index_arbuffer,
+			 rx->ac3rbuffer, rx->index_ac3rbuffer);
+}
+
 
 
-#define IN_SIZE (1000*TS_SIZE)
+// takes the PIDs that were not given on the command line
+static void set_pids(struct replex *rx, uint16_t vpid, uint16_t apid, 
+		     uint16_t ac3pid, int *vfound, int *afound)
+{
+	if (!rx->vpid && vpid){
+		rx->vpid = vpid;
+		fprintf(stderr,"vpid 0x%04x  \n",
+			(int)rx->vpid);
+		(*vfound)++;
+	}
+	if (!rx->apidn && apid){
+		rx->apid[0] = apid;
+		fprintf(stderr,"apid 0x%04x  \n",
+			(int)rx->apid[0]);
+		rx->apidn++;
+		(*afound)++;
+	}
+	if (!rx->ac3n && ac3pid){
+		rx->ac3_id[0] = ac3pid;
+		fprintf(stderr,"ac3pid 0x%04x  \n",
+			(int)rx->ac3_id[0]);
+		rx->ac3n++;
+		(*afound)++;
+	}
+}
+
+// a PID given on the command line selects the program
+static uint16_t wanted_pid(struct replex *rx)
+{
+	if (rx->vpid) return rx->vpid;
+	if (rx->apidn) return rx->apid[0];
+	if (rx->ac3n) return rx->ac3_id[0];
+	return 0;
+}
+
+#define PSI_SCAN (4*IN_SIZE)
+// PAT and PMTs from the start of the file
+static int read_psi(struct replex *rx, ts_psi *psi, uint8_t *buf)
+{
+	int count = 0;
+	int re;
+	int done = 0;
+
+	ts_psi_init(psi);
+	while (!done && count < PSI_SCAN && count < rx->inflength){
+		if ((re = save_read(rx, buf, IN_SIZE)) <= 0) break;
+		count += re;
+		if (!rx->ts_stride && !(rx->ts_stride = ts_stride(buf, re, NULL)))
+			break;
+		done = ts_psi_find(psi, buf, re, rx->ts_stride);
+	}
+	lseek(rx->fd_in,0,SEEK_SET);
+	return psi->nprog;
+}
+
 void find_pids_file(struct replex *rx)
 {
 	uint8_t buf[IN_SIZE];
+	ts_psi psi;
 	int afound=0;
 	int vfound=0;
 	int count=0;
@@ -1364,6 +1739,15 @@ void find_pids_file(struct replex *rx)
 	uint16_t vpid=0, apid=0, ac3pid=0;
 	
 	fprintf(stderr,"Trying to find PIDs\n");
+	if (read_psi(rx, &psi, buf) && 
+	    ts_psi_pids(&psi, wanted_pid(rx), &vpid, &apid, &ac3pid)){
+		if (rx->vpid) vfound = 1;
+		if (rx->apidn) afound = 1;
+		set_pids(rx, vpid, apid, ac3pid, &vfound, &afound);
+		if (vfound && afound) return;
+	}
+
+	// no usable PSI, look at the PES headers
 	while (!afound && !vfound && count < rx->inflength){
 		if (rx->vpid) vfound = 1;
 		if (rx->apidn) afound = 1;
@@ -1371,30 +1755,9 @@ void find_pids_file(struct replex *rx)
 			perror("reading");
 		else
 			count += re;
-		if ( (re = find_pids(&vpid, &apid, &ac3pid, buf, re))){
-			if (!rx->vpid && vpid){
-				rx->vpid = vpid;
-				fprintf(stderr,"vpid 0x%04x  \n",
-					(int)rx->vpid);
-				vfound++;
-			}
-			if (!rx->apidn && apid){
-				rx->apid[0] = apid;
-				fprintf(stderr,"apid 0x%04x  \n",
-					(int)rx->apid[0]);
-				rx->apidn++;
-				afound++;
-			}
-			if (!rx->ac3n && ac3pid){
-				rx->ac3_id[0] = ac3pid;
-				fprintf(stderr,"ac3pid 0x%04x  \n",
-					(int)rx->ac3_id[0]);
-				rx->ac3n++;
-				afound++;
-			}
-			
-		}
-		
+		if ( (re = find_pids(&vpid, &apid, &ac3pid, buf, re, 
+				     rx->ts_stride)))
+			set_pids(rx, vpid, apid, ac3pid, &vfound, &afound);
 	}
 	
 	lseek(rx->fd_in,0,SEEK_SET);
@@ -1411,8 +1774,9 @@ void find_pids_file(struct replex *rx)
 void find_all_pids_file(struct replex *rx)
 {
 	uint8_t buf[IN_SIZE];
+	ts_psi psi;
 	int count=0;
-	int j;
+	int i,j;
 	int re=0;
 	uint16_t vpid[MAXVPID], apid[MAXAPID], ac3pid[MAXAC3PID];
 	int vn=0, an=0,ac3n=0;
@@ -1424,12 +1788,37 @@ void find_all_pids_file(struct replex *rx)
 	memset (ac3pid , 0 , MAXAC3PID*sizeof(uint16_t));
 	
 	fprintf(stderr,"Trying to find PIDs\n");
+	if (read_psi(rx, &psi, buf)){
+		int found = 0;
+
+		for (i=0; i < psi.nprog; i++){
+			ts_program *p = &psi.prog[i];
+			
+			if (!p->done) continue;
+			found++;
+			printf("program %d: PMT pid 0x%04x (%d)\n",
+			       (int)p->number, (int)p->pmt_pid, 
+			       (int)p->pmt_pid);
+			if (p->vpid)
+				printf("vpid 1: 0x%04x (%d)\n",
+				       (int)p->vpid, (int)p->vpid);
+			for (j=0; j < p->apidn; j++)
+				printf("apid %d: 0x%04x (%d)\n", j+1,
+				       (int)p->apid[j], (int)p->apid[j]);
+			for (j=0; j < p->ac3n; j++)
+				printf("ac3pid %d: 0x%04x (%d) \n", j+1,
+				       (int)p->ac3pid[j], (int)p->ac3pid[j]);
+		}
+		if (found) return;
+	}
+
+	// no complete PMT, look at the PES headers of the whole file
 	while (count < rx->inflength-IN_SIZE){
 		if ((re = save_read(rx,buf,IN_SIZE))<0)
 			perror("reading");
 		else
 			count += re;
-		if ( (re = find_pids_pos(&vp, &ap, &cp, buf, re,
+		if ( (re = find_pids_pos(&vp, &ap, &cp, buf, re, rx->ts_stride,
 					 &vpos, &apos, &cpos))){
 			if (vp){
 				int old=0;
@@ -1496,11 +1885,19 @@ void find_pids_stdin(struct replex *rx, uint8_t *buf, int len)
 	int afound=0;
 	int vfound=0;
 	uint16_t vpid=0, apid=0, ac3pid=0;
+	ts_psi *psi = &rx->psi;
 	
 	if (rx->vpid) vfound = 1;
 	if (rx->apidn) afound = 1;
 	fprintf(stderr,"Trying to find PIDs\n");
-	if ( find_pids(&vpid, &apid, &ac3pid, buf, len) ){
+
+	// with a PAT the PMTs are worth waiting for
+	rx->psi_count += len;
+	if (!ts_psi_find(psi, buf, len, rx->ts_stride) && psi->nprog && 
+	    rx->psi_count < PSI_SCAN) return;
+
+	if ( ts_psi_pids(psi, wanted_pid(rx), &vpid, &apid, &ac3pid) ||
+	     find_pids(&vpid, &apid, &ac3pid, buf, len, rx->ts_stride) ){
 		if (!rx->vpid && vpid){
 			rx->vpid = vpid;
 			vfound++;
@@ -1512,7 +1909,7 @@ void find_pids_stdin(struct replex *rx, uint8_t *buf, int len)
 			ring_init(&rx->arbuffer[0], rx->audiobuf);
 			init_pes_in(&rx->paudio[0], 1, &rx->arbuffer[0], 0);
 			rx->paudio[0].priv = (void *) rx;
-			ring_init(&rx->index_arbuffer[0], INDEX_BUF);
+			index_init(&rx->index_arbuffer[0], INDEX_BUF);
 			memset(&rx->aframe[0], 0, sizeof(audio_frame_t));
 			init_index(&rx->current_aindex[0]);
 			rx->aframe_count[0] = 0;
@@ -1526,13 +1923,13 @@ void find_pids_stdin(struct replex *rx, uint8_t *buf, int len)
 			ring_init(&rx->ac3rbuffer[0], rx->ac3buf);
 			init_pes_in(&rx->pac3[0], 0x80, &rx->ac3rbuffer[0],0);
 			rx->pac3[0].priv = (void *) rx;
-			ring_init(&rx->index_ac3rbuffer[0], INDEX_BUF);
+			index_init(&rx->index_ac3rbuffer[0], INDEX_BUF);
 			memset(&rx->ac3frame[0], 0, sizeof(audio_frame_t));
 			init_index(&rx->current_ac3index[0]);
 			rx->ac3frame_count[0] = 0;
 			rx->first_ac3pts[0] = 0;
 		}
-		
+		pid_table(rx);
 	}
 	
 	if (afound && vfound){
@@ -1729,46 +2126,62 @@ void replex_finish(struct replex *rx)
 		exit(1);
 	}
 	
+	workers_stop(rx);
+	if (rx->batch.sync_err || rx->batch.trans_err || rx->batch.scrambled)
+		fprintf(stderr,"TS packets: %llu  sync errors: %llu  "
+			"transport errors: %llu  scrambled: %llu\n",
+			(unsigned long long)rx->batch.packets,
+			(unsigned long long)rx->batch.sync_err,
+			(unsigned long long)rx->batch.trans_err,
+			(unsigned long long)rx->batch.scrambled);
 	if (!rx->demux)
 		finish_mpg((multiplex_t *)rx->priv);
 	exit(0);
 }
 
-int replex_fill_buffers(struct replex *rx, uint8_t *mbuf)
+// number of bytes read for a given fill size
+static int chunk_size(struct replex *rx, int fill)
 {
-	uint8_t buf[IN_SIZE];
-	int i,j;
+	switch(rx->itype){
+	case REPLEX_TS:
+		// as many packets as 188 byte packets would give
+		if (fill < IN_SIZE) return (fill/TS_SIZE)*rx->ts_stride;
+		return (IN_SIZE/TS_SIZE)*rx->ts_stride;
+	default:
+		if (fill > IN_SIZE) return IN_SIZE;
+		return fill;
+	}
+}
+
+static void replex_eof(struct replex *rx)
+{
+	// the demux thread only marks the end, the multiplexer finishes
+	if (rx->pipe && rx->pipe->running)
+		rx->pipe->eof = 1;
+	else 
+		replex_finish(rx);
+}
+
+static int replex_read_chunk(struct replex *rx, uint8_t *mbuf, int fill)
+{
+	uint8_t buf[(IN_SIZE/TS_SIZE)*TS_RS_SIZE];
+	uint8_t *rbuf = buf;
+	int i,j,n;
 	int count=0;
-	int fill;
 	int re;
 	int rsize;
 	int tries = 0;
 
-	if (rx->finish) return 0;
-	fill =  guess_fill(rx);
-	//fprintf(stderr,"trying to fill buffers with %d\n",fill);
-	if (fill < 0) return -1;
+	rsize = chunk_size(rx, fill);
 
-	memset(buf, 0, IN_SIZE);
-	
 	switch(rx->itype){
 	case REPLEX_TS:
-		if (fill < IN_SIZE){
-			rsize = fill - (fill%188);
-		} else rsize = IN_SIZE;
-		
 //	fprintf(stderr,"filling with %d\n",rsize);
 		
 		if (!rsize) return 0;
 		
-		memset(buf, 0, IN_SIZE);
-		
 		if ( mbuf ){
-			for ( i = 0; i < 188 ; i++){
-				if ( mbuf[i] == 0x47 ) break;
-			}
-			
-			if ( i == 188){
+			if ( !ts_stride(mbuf, 2*TS_SIZE, &i)){
 				fprintf(stderr,"Not a TS\n");
 				return -1;
 			} else {
@@ -1776,28 +2189,45 @@ int replex_fill_buffers(struct replex *rx, uint8_t *mbuf)
 				if ((count = save_read(rx,mbuf,i))<0)
 					perror("reading");
 				memcpy(buf+2*TS_SIZE-i,mbuf,i);
-				i = 188;
+				// both packets are data, the first one may be video
+				i = 2*TS_SIZE;
 			}
 		} else i=0;
 
 	
 #define MAX_TRIES 5
 		while (count < rsize && tries < MAX_TRIES){
-			if ((re = save_read(rx,buf+i,rsize-i)+i)<0)
-				perror("reading");
-			else 
-				count += re;
+			if (rx->inmap.running && !mbuf){
+				if ((re = save_map(rx, &rbuf, rsize))<0)
+					perror("mapping");
+				else 
+					count += re;
+			} else {
+				rbuf = buf;
+				if ((re = save_read(rx,buf+i,rsize-i)+i)<0)
+					perror("reading");
+				else 
+					count += re;
+			}
 			tries++;
 			
 			if (!rx->vpid || !(rx->apidn || rx->ac3n)){
-				find_pids_stdin(rx, buf, re);
+				find_pids_stdin(rx, rbuf, re);
 			}
 
-			for( j = 0; j < re; j+= TS_SIZE){
-				
-				if ( re - j < TS_SIZE) break;
-				
-				if ( replex_tsp( rx, buf+j) < 0){
+			if (rx->es_threads && !rx->workers && rx->vpid &&
+			    (rx->apidn || rx->ac3n) && workers_start(rx) < 0)
+				rx->es_threads = 0;
+			if (rx->workers){
+				workers_tsp(rx, rbuf, re);
+				i=0;
+				continue;
+			}
+
+			n = ts_classify(rx, rbuf, re);
+			for( j = 0; j < n; j++){
+				if ( replex_tsp_pes( rx->batch.pes[j], 
+						     rx->batch.pkt[j]) < 0){
 					fprintf(stderr, "Error reading TS\n");
 					exit(1);
 				}
@@ -1806,38 +2236,42 @@ int replex_fill_buffers(struct replex *rx, uint8_t *mbuf)
 		}
 		
 		if (tries == MAX_TRIES)
-			replex_finish(rx);
+			replex_eof(rx);
 		return 0;
 		break;
 		
 	case REPLEX_PS:
-		rsize = fill;
-		if (fill > IN_SIZE) rsize = IN_SIZE; 
 		if (mbuf)
 			get_pes(&rx->pvideo, mbuf, 2*TS_SIZE, pes_es_out);
 		
 		while (count < rsize && tries < MAX_TRIES){
-			if ((re = save_read(rx, buf, rsize))<0)
-				perror("reading PS");
-			else 
-				count += re;
+			if (rx->inmap.running){
+				if ((re = save_map(rx, &rbuf, rsize))<0)
+					perror("mapping PS");
+				else 
+					count += re;
+			} else {
+				rbuf = buf;
+				if ((re = save_read(rx, buf, rsize))<0)
+					perror("reading PS");
+				else 
+					count += re;
+			}
 	
-			get_pes(&rx->pvideo, buf, re, pes_es_out);
+			get_pes(&rx->pvideo, rbuf, re, pes_es_out);
 			
 			tries++;
 			
 		}
 		
 		if (tries == MAX_TRIES)
-			replex_finish(rx);
+			replex_eof(rx);
 		return 0;
 		break;
 
 
 	case REPLEX_AVI:
-		rsize = fill;
-		if (fill > IN_SIZE) rsize = IN_SIZE; 
-		
+
 		if (!(rx->ac.avih_flags & AVI_HASINDEX)){
 
 			if (mbuf){
@@ -1861,7 +2295,7 @@ int replex_fill_buffers(struct replex *rx, uint8_t *mbuf)
 		}
 
 		if (tries == MAX_TRIES)
-			replex_finish(rx);
+			replex_eof(rx);
 		return 0;
 		break;
 	}
@@ -1869,6 +2303,18 @@ int replex_fill_buffers(struct replex *rx, uint8_t *mbuf)
 	return -1;
 }
 
+int replex_fill_buffers(struct replex *rx, uint8_t *mbuf)
+{
+	int fill;
+
+	if (rx->finish) return 0;
+	fill =  guess_fill(rx);
+	//fprintf(stderr,"trying to fill buffers with %d\n",fill);
+	if (fill < 0) return -1;
+
+	return replex_read_chunk(rx, mbuf, fill);
+}
+
 int fill_buffers(void *r, int finish)
 {
 	struct replex *rx = (struct replex *)r;
@@ -1878,6 +2324,191 @@ int fill_buffers(void *r, int finish)
 	return replex_fill_buffers(rx, NULL);
 }
 
+static void pipe_add(replex_pipe *pp, ringbuffer *ring, ringbuffer *view)
+{
+	pp->ring[pp->nrings] = ring;
+	pp->view[pp->nrings] = view;
+	pp->nrings++;
+}
+
+static int pipe_init(struct replex *rx)
+{
+	replex_pipe *pp;
+	int i;
+
+	if (!(pp = malloc(sizeof(replex_pipe)))){
+		fprintf(stderr,"Not enough memory for pipeline\n");
+		return -1;
+	}
+	memset(pp, 0, sizeof(replex_pipe));
+	pipe_add(pp, &rx->vrbuffer, &pp->vrbuffer);
+	pipe_add(pp, &rx->index_vrbuffer, &pp->index_vrbuffer);
+	for (i=0; i<rx->apidn; i++){
+		pipe_add(pp, &rx->arbuffer[i], &pp->arbuffer[i]);
+		pipe_add(pp, &rx->index_arbuffer[i], &pp->index_arbuffer[i]);
+	}
+	for (i=0; i<rx->ac3n; i++){
+		pipe_add(pp, &rx->ac3rbuffer[i], &pp->ac3rbuffer[i]);
+		pipe_add(pp, &rx->index_ac3rbuffer[i], 
+			 &pp->index_ac3rbuffer[i]);
+	}
+	pthread_mutex_init(&pp->lock, NULL);
+	pthread_cond_init(&pp->cond, NULL);
+	rx->pipe = pp;
+
+	return 0;
+}
+
+/* The next chunk may be read ahead if the multiplexer is bound to 
+   ask for a full IN_SIZE chunk, i.e. if every ring has enough free
+   space even with the read positions it has reported so far.
+   Otherwise the demuxer waits for the exact fill size. */
+static int pipe_ahead(replex_pipe *pp)
+{
+	ringbuffer r;
+	int i;
+
+	for (i=0; i < pp->nrings; i++){
+		r = *pp->ring[i];
+		r.read_pos = pp->rpos[i];
+		if (ring_free(&r)/2 < IN_SIZE) return 0;
+	}
+	return 1;
+}
+
+static void *pipe_thread(void *p)
+{
+	struct replex *rx = (struct replex *)p;
+	replex_pipe *pp = rx->pipe;
+	int i, c, fill;
+
+	for (;;){
+		pthread_mutex_lock(&pp->lock);
+		for (;;){
+			fill = 0;
+			if (pp->stop) break;
+			if (pp->ccount < PIPE_DEPTH){
+				if (pp->request && !pp->ccount)
+					fill = pp->request;
+				else if (pipe_ahead(pp))
+					fill = IN_SIZE;
+			}
+			if (fill) break;
+			pthread_cond_wait(&pp->cond, &pp->lock);
+		}
+		if (pp->stop){
+			pthread_mutex_unlock(&pp->lock);
+			break;
+		}
+		pp->request = 0;
+		for (i=0; i < pp->nrings; i++)
+			pp->ring[i]->read_pos = pp->rpos[i];
+		pthread_mutex_unlock(&pp->lock);
+
+		replex_read_chunk(rx, NULL, fill);
+
+		pthread_mutex_lock(&pp->lock);
+		c = (pp->chead + pp->ccount) % PIPE_DEPTH;
+		for (i=0; i < pp->nrings; i++)
+			pp->wpos[c][i] = pp->ring[i]->write_pos;
+		pp->last[c] = pp->eof;
+		pp->ccount++;
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+		if (pp->eof) break;
+	}
+
+	return NULL;
+}
+
+static int pipe_start(struct replex *rx)
+{
+	replex_pipe *pp = rx->pipe;
+	int i;
+
+	for (i=0; i < pp->nrings; i++){
+		*pp->view[i] = *pp->ring[i];
+		pp->rpos[i] = pp->ring[i]->read_pos;
+	}
+	pp->running = 1;
+	if (pthread_create(&pp->thread, NULL, pipe_thread, rx)){
+		fprintf(stderr,"Can't start demux thread\n");
+		pp->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void pipe_stop(struct replex *rx)
+{
+	replex_pipe *pp = rx->pipe;
+
+	if (!pp || !pp->running) return;
+	pthread_mutex_lock(&pp->lock);
+	pp->stop = 1;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+	pthread_join(pp->thread, NULL);
+	pp->running = 0;
+}
+
+/* fill_buffers() of the multiplexer in pipelined mode: decides like
+   replex_fill_buffers() whether a chunk would be read and takes the
+   next one from the demux thread */
+int pipe_fill_buffers(void *r, int finish)
+{
+	struct replex *rx = (struct replex *)r;
+	replex_pipe *pp = rx->pipe;
+	int i, c, fill, last;
+
+	rx->finish = finish;
+	if (rx->finish) return 0;
+
+	fill = fill_size(rx->apidn, rx->ac3n, 
+			 &pp->vrbuffer, &pp->index_vrbuffer,
+			 pp->arbuffer, pp->index_arbuffer,
+			 pp->ac3rbuffer, pp->index_ac3rbuffer);
+	if (fill < 0) return -1;
+
+	pthread_mutex_lock(&pp->lock);
+	for (i=0; i < pp->nrings; i++)
+		pp->rpos[i] = pp->view[i]->read_pos;
+
+	if (!chunk_size(rx, fill)){
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+		return 0;
+	}
+
+	while (!pp->ccount){
+		if (!pp->running || pp->stop){
+			pthread_mutex_unlock(&pp->lock);
+			return -1;
+		}
+		pp->request = fill;
+		pthread_cond_broadcast(&pp->cond);
+		pthread_cond_wait(&pp->cond, &pp->lock);
+	}
+	pp->request = 0;
+
+	c = pp->chead;
+	for (i=0; i < pp->nrings; i++)
+		pp->view[i]->write_pos = pp->wpos[c][i];
+	last = pp->last[c];
+	pp->chead = (c+1) % PIPE_DEPTH;
+	pp->ccount--;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+
+	if (last){
+		pthread_join(pp->thread, NULL);
+		pp->running = 0;
+		replex_finish(rx);
+	}
+
+	return 0;
+}
+
 
 void init_index(index_unit *iu)
 {
@@ -1917,12 +2548,13 @@ int check_stream_type(struct replex *rx, uint8_t * buf, int len)
 	}
 
 	fprintf(stderr, "Checking for TS: ");
-	while (c < len && buf[c]!=0x47) c++;
-	if (c<len && len-c>=TS_SIZE){
-		if (buf[c+TS_SIZE] == 0x47){
+	if ((rx->ts_stride = ts_stride(buf, len, &c))){
+		if (rx->ts_stride == TS_SIZE)
 			fprintf(stderr,"confirmed\n");
-			return REPLEX_TS;
-		} else  fprintf(stderr,"failed\n");
+		else
+			fprintf(stderr,"confirmed (%d byte packets)\n",
+				rx->ts_stride);
+		return REPLEX_TS;
 	} else  fprintf(stderr,"failed\n");
 
 	fprintf(stderr, "Checking for AVI: ");
@@ -1973,6 +2605,9 @@ void init_replex(struct replex *rx,int bufsize)
 		if (!rx->vpid || !(rx->apidn || rx->ac3n)){
 			if (rx->inflength){
 				find_pids_file(rx);
+				// mbuf still holds the start, go on behind it
+				if (rx->ts_stride != TS_SIZE)
+					lseek(rx->fd_in, 2*TS_SIZE, SEEK_SET);
 			}
 		}
 	}	
@@ -2001,7 +2636,7 @@ void init_replex(struct replex *rx,int bufsize)
 	} else init_pes_in(&rx->pvideo, 0, NULL, 1);
 	
 	rx->pvideo.priv = (void *) rx;
-	ring_init(&rx->index_vrbuffer, INDEX_BUF);
+	index_init(&rx->index_vrbuffer, INDEX_BUF);
 	memset(&rx->seq_head, 0, sizeof(sequence_t));
 	init_index(&rx->current_vindex);
 	rx->vgroup_count = 0;
@@ -2021,7 +2656,7 @@ void init_replex(struct replex *rx,int bufsize)
 				    &rx->arbuffer[i], 0);
 			rx->paudio[i].priv = (void *) rx;
 		}
-		ring_init(&rx->index_arbuffer[i], INDEX_BUF);	
+		index_init(&rx->index_arbuffer[i], INDEX_BUF);	
 		memset(&rx->aframe[i], 0, sizeof(audio_frame_t));
 		init_index(&rx->current_aindex[i]);
 		rx->aframe_count[i] = 0;
@@ -2038,14 +2673,22 @@ void init_replex(struct replex *rx,int bufsize)
 				    &rx->ac3rbuffer[i],0);
 			rx->pac3[i].priv = (void *) rx;
 		}
-		ring_init(&rx->index_ac3rbuffer[i], INDEX_BUF);
+		index_init(&rx->index_ac3rbuffer[i], INDEX_BUF);
 		memset(&rx->ac3frame[i], 0, sizeof(audio_frame_t));
 		init_index(&rx->current_ac3index[i]);
 		rx->ac3frame_count[i] = 0;
 		rx->first_ac3pts[i] = 0;
 		rx->last_ac3pts[i] = 0;
 	}	
+	pid_table(rx);
 	
+	// AVI input seeks around in the file, so no read ahead for it
+	if (rx->read_ahead && !rx->use_mmap && rx->itype != REPLEX_AVI){
+		if (reader_start(&rx->reader, rx->fd_in, rx->read_ahead, 
+				 READ_BLOCK) < 0)
+			exit(1);
+	}
+
 	if (rx->itype == REPLEX_TS){
 		if (replex_fill_buffers(rx, mbuf)< 0){
 			fprintf(stderr,"error filling buffer\n");
@@ -2099,38 +2742,41 @@ void init_replex(struct replex *rx,int bufsize)
 		}
 	}
 
+	// map the rest of the input after the first (unaligned) read
+	if (rx->use_mmap && rx->itype != REPLEX_AVI){
+		if (!rx->inflength){
+			fprintf(stderr,"Can't map a pipe, using read\n");
+		} else {
+			map_start(&rx->inmap, rx->fd_in, 
+				  lseek(rx->fd_in, 0, SEEK_CUR), rx->inflength);
+		}
+	}
 }
 
 
 void fix_audio(struct replex *rx, multiplex_t *mx)
 {
 	int i;
-	index_unit aiu;
-	int size;
-
-	size = sizeof(index_unit);
+	index_unit *aiu;
 
 	for ( i = 0; i < rx->apidn; i++){
 		do {
-			while (ring_avail(&rx->index_arbuffer[i]) < 
-			       sizeof(index_unit)){
+			while (!(aiu = index_peek(&rx->index_arbuffer[i], 0))){
 				if (replex_fill_buffers(rx, 0)< 0){
 					fprintf(stderr,
 						"error in fix audio\n");
 					exit(1);
 				}	
 			}
-			ring_peek(&rx->index_arbuffer[i], (uint8_t *)&aiu, 
-				  size, 0);
-			if ( ptscmp(aiu.pts + rx->first_apts[i], rx->first_vpts) < 0){
-				ring_skip(&rx->index_arbuffer[i], size);
-				ring_skip(&rx->arbuffer[i], aiu.length);
+			if ( ptscmp(aiu->pts + rx->first_apts[i], rx->first_vpts) < 0){
+				ring_skip(&rx->arbuffer[i], aiu->length);
+				index_skip(&rx->index_arbuffer[i]);
 			} else break;
 
 		} while (1);
-		mx->apts_off[i] = aiu.pts;
-		rx->apts_off[i] = aiu.pts;
-		mx->aframes[i] = aiu.framesize;
+		mx->apts_off[i] = aiu->pts;
+		rx->apts_off[i] = aiu->pts;
+		mx->aframes[i] = aiu->framesize;
 		
 		fprintf(stderr,"Audio%d  offset: ",i);
 		printpts(mx->apts_off[i]);
@@ -2140,23 +2786,20 @@ void fix_audio(struct replex *rx, multiplex_t *mx)
 			  
 	for ( i = 0; i < rx->ac3n; i++){
 		do {
-			while (ring_avail(&rx->index_ac3rbuffer[i]) < 
-			       sizeof(index_unit)){
+			while (!(aiu = index_peek(&rx->index_ac3rbuffer[i], 0))){
 				if (replex_fill_buffers(rx, 0)< 0){
 					fprintf(stderr,
 						"error in fix audio\n");
 					exit(1);
 				}	
 			}
-			ring_peek(&rx->index_ac3rbuffer[i],(uint8_t *) &aiu, 
-				  size, 0);
-			if ( ptscmp (aiu.pts+rx->first_ac3pts[i], rx->first_vpts) < 0){
-				ring_skip(&rx->index_ac3rbuffer[i], size);
-				ring_skip(&rx->ac3rbuffer[i], aiu.length);
+			if ( ptscmp (aiu->pts+rx->first_ac3pts[i], rx->first_vpts) < 0){
+				ring_skip(&rx->ac3rbuffer[i], aiu->length);
+				index_skip(&rx->index_ac3rbuffer[i]);
 			} else break;
 		} while (1);
-		mx->ac3pts_off[i] = aiu.pts;
-		rx->ac3pts_off[i] = aiu.pts;
+		mx->ac3pts_off[i] = aiu->pts;
+		rx->ac3pts_off[i] = aiu->pts;
 		
 		fprintf(stderr,"AC3%d  offset: ",i);
 		printpts(mx->ac3pts_off[i]);
@@ -2170,33 +2813,17 @@ void fix_audio(struct replex *rx, multiplex_t *mx)
 
 static int get_next_video_unit(struct replex *rx, index_unit *viu)
 {
-	if (ring_avail(&rx->index_vrbuffer)){
-		ring_read(&rx->index_vrbuffer, (uint8_t *)viu, 
-			  sizeof(index_unit));
-		return 1;
-	}
-	return 0;
+	return index_read(&rx->index_vrbuffer, viu);
 }
 
 static int get_next_audio_unit(struct replex *rx, index_unit *aiu, int i)
 {
-	if(ring_avail(&rx->index_arbuffer[i])){
-		ring_read(&rx->index_arbuffer[i], (uint8_t *)aiu, 
-			  sizeof(index_unit));
-		return 1;
-	}
-	return 0;
+	return index_read(&rx->index_arbuffer[i], aiu);
 }
 
 static int get_next_ac3_unit(struct replex *rx, index_unit *aiu, int i)
 {
-	if (ring_avail(&rx->index_ac3rbuffer[i])){
-		ring_read(&rx->index_ac3rbuffer[i], (uint8_t *)aiu, 
-			  sizeof(index_unit));
-		
-		return 1;
-	} 
-	return 0;
+	return index_read(&rx->index_ac3rbuffer[i], aiu);
 }
 
 
@@ -2352,8 +2979,92 @@ void do_scan(struct replex *rx)
 	
 }
 
+// writes all of iov, which is changed on the way
+static int writev_all(int fd, struct iovec *iov, int n)
+{
+	ssize_t re;
+
+	while (n){
+		if ((re = writev(fd, iov, n)) <= 0){
+			if (re < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		while (n && re >= iov->iov_len){
+			re -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n){
+			iov->iov_base = (uint8_t *)iov->iov_base + re;
+			iov->iov_len -= re;
+		}
+	}
+	return 0;
+}
+
+// collects the units of one track and writes them with writev
+#define DMX_IOV 256
+typedef struct dmx_writer_s {
+	int fd;
+	ringbuffer *rbuf;
+	struct iovec iov[DMX_IOV];
+	int niov;
+	int covered;
+} dmx_writer;
+
+static void dmx_init(dmx_writer *w, int fd, ringbuffer *rbuf)
+{
+	w->fd = fd;
+	w->rbuf = rbuf;
+	w->niov = 0;
+	w->covered = 0;
+}
+
+static void dmx_flush(dmx_writer *w)
+{
+	if (writev_all(w->fd, w->iov, w->niov) < 0)
+		perror("Error writing demux output");
+	if (w->covered) ring_skip(w->rbuf, w->covered);
+	w->niov = 0;
+	w->covered = 0;
+}
+
+static void dmx_add(dmx_writer *w, uint8_t *data, int length)
+{
+	if (w->niov){
+		struct iovec *last = &w->iov[w->niov-1];
+
+		if ((uint8_t *)last->iov_base + last->iov_len == data){
+			last->iov_len += length;
+			return;
+		}
+	}
+	if (w->niov == DMX_IOV) dmx_flush(w);
+	w->iov[w->niov].iov_base = data;
+	w->iov[w->niov].iov_len = length;
+	w->niov++;
+}
+
+static void dmx_add_ring(dmx_writer *w, int length)
+{
+	struct iovec iov[2];
+	int i, n;
+
+	if ((n = ring_iov(w->rbuf, iov, length, w->covered)) < 0) return;
+	for (i = 0; i < n; i++) 
+		dmx_add(w, iov[i].iov_base, iov[i].iov_len);
+	w->covered += length;
+}
+
+static void dmx_skip(dmx_writer *w, int length)
+{
+	if (length > 0 && w->covered + length <= ring_avail(w->rbuf))
+		w->covered += length;
+}
+
 void do_demux(struct replex *rx)
 {
+	dmx_writer w;
 	index_unit dummy;
 	index_unit dummy2;
 	int i;
@@ -2376,52 +3087,433 @@ void do_demux(struct replex *rx)
 			return;
 		}
 		for (i=0; i< rx->apidn; i++){
+			dmx_init(&w, rx->dmx_out[i+1], &rx->arbuffer[i]);
 			while(get_next_audio_unit(rx, &dummy2, i)){
 				switch(dummy2.err){
 				case JUMP_ERR:
-					ring_skip(&rx->arbuffer[i],dummy2.length);
+					dmx_skip(&w, dummy2.length);
 					break;
 				case DUMMY_ERR:
-					write(rx->dmx_out[i+1],dummy.fillframe,dummy2.length);
+					dmx_add(&w, dummy2.fillframe, 
+						dummy2.length);
 					break; 
 				default:
-					ring_read_file(&rx->arbuffer[i], 
-						       rx->dmx_out[i+1], 
-						       dummy2.length);
+					dmx_add_ring(&w, dummy2.length);
 				}
 			}
+			dmx_flush(&w);
 		}
 		
 		for (i=0; i< rx->ac3n; i++){
+			dmx_init(&w, rx->dmx_out[i+1+rx->apidn], 
+				 &rx->ac3rbuffer[i]);
 			while(get_next_ac3_unit(rx, &dummy2, i)){
 				switch(dummy2.err){
 				case JUMP_ERR:
-					ring_skip(&rx->ac3rbuffer[i],dummy2.length);
+					dmx_skip(&w, dummy2.length);
 					break;
 				case DUMMY_ERR:
-					write(rx->dmx_out[i+1+rx->apidn],dummy.fillframe,dummy2.length);
+					dmx_add(&w, dummy2.fillframe, 
+						dummy2.length);
 					break; 
 				default:
-					ring_read_file(&rx->ac3rbuffer[i], 
-						       rx->dmx_out[i+1+rx->apidn], 
-						       dummy2.length);
+					dmx_add_ring(&w, dummy2.length);
 				}
 			}
+			dmx_flush(&w);
 		}
 		
+		dmx_init(&w, rx->dmx_out[0], &rx->vrbuffer);
 		while (get_next_video_unit(rx, &dummy)){
-			ring_read_file(&rx->vrbuffer, rx->dmx_out[0], 
-				       dummy.length);
+			dmx_add_ring(&w, dummy.length);
+		}
+		dmx_flush(&w);
+	}
+}
+
+
+/* the parts of a split file report where they start and get back the
+   start of the whole file and the start of the next part, which is
+   where they end */
+static void segment_sync(struct replex *rx, multiplex_t *mx)
+{
+	seg_times t, first;
+	index_unit *iu;
+	uint64_t delay, span;
+	int i, re;
+
+	memset(&t, 0, sizeof(t));
+	t.vpts = rx->first_vpts;
+	for (i = 0; i < rx->apidn; i++){
+		t.apts[i] = (rx->first_apts[i] + rx->apts_off[i]) % MAX_PTS2;
+		if ((iu = index_peek(&rx->index_arbuffer[i], 0)))
+			t.asum[i] = seg_frame_sum(&rx->arbuffer[i], iu);
+	}
+	for (i = 0; i < rx->ac3n; i++){
+		t.ac3pts[i] = (rx->first_ac3pts[i] + rx->ac3pts_off[i])
+			% MAX_PTS2;
+		if ((iu = index_peek(&rx->index_ac3rbuffer[i], 0)))
+			t.ac3sum[i] = seg_frame_sum(&rx->ac3rbuffer[i], iu);
+	}
+
+	if (write(rx->seg_out, &t, sizeof(t)) != sizeof(t) ||
+	    read(rx->seg_in, &first, sizeof(first)) != sizeof(first) ||
+	    (re = read(rx->seg_in, &rx->seg_end, sizeof(seg_times))) < 0 ||
+	    (re && re != sizeof(seg_times))){
+		fprintf(stderr,"Lost the main process of part %d\n", 
+			rx->segment);
+		exit(1);
+	}
+	close(rx->seg_out);
+	close(rx->seg_in);
+	// the last part gets no end
+	rx->seg_cut = (re == sizeof(seg_times));
+
+	// video and SCR move by the distance of the first frames
+	delay = uptsdiff(t.vpts, first.vpts);
+	mx->video_delay += delay;
+	mx->audio_delay += delay;
+	mx->startSCR = delay;
+
+	/* every audio stream keeps the frame raster of the first part,
+	   its first frame is a whole number of frames after the first
+	   frame of the file */
+	for (i = 0; i < rx->apidn; i++){
+		span = add_pts_audio(0, &rx->aframe[i], 
+				     cfix_audio_count(&rx->aframe[i], 
+						      t.apts[i], first.apts[i]));
+		mx->apts_off[i] = (mx->apts_off[i] + delay + MAX_PTS2 - span)
+			% MAX_PTS2;
+	}
+	for (i = 0; i < rx->ac3n; i++){
+		span = add_pts_audio(0, &rx->ac3frame[i], 
+				     cfix_audio_count(&rx->ac3frame[i], 
+						      t.ac3pts[i], 
+						      first.ac3pts[i]));
+		mx->ac3pts_off[i] = (mx->ac3pts_off[i] + delay + 
+				     MAX_PTS2 - span) % MAX_PTS2;
+	}
+
+	fprintf(stderr,"Part %d starts at ", rx->segment);
+	printpts(delay);
+	fprintf(stderr,"\n");
+}
+
+/* splits the input at sequence headers into n parts which are
+   multiplexed by child processes into temporary files, only the
+   children return */
+static void segment_replex(struct replex *rx, int n, char *filename)
+{
+	uint64_t off[MAX_SEGMENTS+1];
+	char *names[MAX_SEGMENTS];
+	int up[MAX_SEGMENTS];
+	int down[MAX_SEGMENTS];
+	pid_t pid[MAX_SEGMENTS];
+	seg_times start[MAX_SEGMENTS];
+	int i, j, k, status;
+	int err = 0;
+
+	if (n > MAX_SEGMENTS) n = MAX_SEGMENTS;
+	if (!rx->vpid || !(rx->apidn || rx->ac3n)){
+		find_pids_file(rx);
+		rx->finread = 0;
+		rx->lastper = 0;
+	}
+	if ((k = seg_split(rx->fd_in, rx->inflength, rx->vpid, n, off)) < 0)
+		exit(1);
+	if (k < 2){
+		fprintf(stderr,"No sequence header to split at\n");
+		return;
+	}
+	fprintf(stderr,"Splitting input into %d parts\n", k);
+
+	for (i = 0; i < k; i++){
+		int pu[2], pd[2];
+
+		names[i] = malloc(strlen(filename)+16);
+		sprintf(names[i], "%s.part%d", filename, i);
+		if (pipe(pu) < 0 || pipe(pd) < 0){
+			perror("Can't create pipe");
+			exit(1);
+		}
+		if ((pid[i] = fork()) < 0){
+			perror("Can't fork");
+			exit(1);
 		}
+		if (!pid[i]){
+			for (j = 0; j < i; j++){
+				close(up[j]);
+				close(down[j]);
+			}
+			close(pu[0]);
+			close(pd[1]);
+			rx->seg_out = pu[1];
+			rx->seg_in = pd[0];
+			rx->segment = i+1;
+
+			// own file offset for every part
+			close(rx->fd_in);
+			if ((rx->fd_in = open(rx->inputFiles[0],
+					      O_RDONLY|O_LARGEFILE)) < 0){
+				perror("Error opening input file");
+				exit(1);
+			}
+			// read on into the next part up to its first frames
+			lseek(rx->fd_in, off[i], SEEK_SET);
+			rx->finread = off[i];
+			if (i < k-1 && off[i+1] + SEG_OVERLAP < off[k])
+				rx->inflength = off[i+1] + SEG_OVERLAP;
+			else rx->inflength = off[k];
+
+			close(rx->fd_out);
+			if ((rx->fd_out = open(names[i], O_WRONLY|O_CREAT
+					       |O_TRUNC|O_LARGEFILE,
+					       S_IRUSR|S_IWUSR)) < 0){
+				perror("Error opening part file");
+				exit(1);
+			}
+			return;
+		}
+		close(pu[1]);
+		close(pd[0]);
+		up[i] = pu[0];
+		down[i] = pd[1];
+	}
+
+	for (i = 0; i < k && !err; i++)
+		if (read(up[i], &start[i], sizeof(seg_times)) 
+		    != sizeof(seg_times)){
+			fprintf(stderr,"Part %d failed\n", i+1);
+			err = 1;
+		}
+	// every part ends where the next one starts
+	for (i = 0; i < k; i++){
+		if (err) kill(pid[i], SIGTERM);
+		else if (write(down[i], &start[0], sizeof(seg_times)) 
+			 != sizeof(seg_times) ||
+			 (i < k-1 && write(down[i], &start[i+1], 
+					   sizeof(seg_times)) 
+			  != sizeof(seg_times))) err = 1;
+		close(up[i]);
+		close(down[i]);
 	}
+	for (i = 0; i < k; i++){
+		if (waitpid(pid[i], &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status)){
+			fprintf(stderr,"Part %d failed\n", i+1);
+			err = 1;
+		}
+	}
+
+	if (!err){
+		fprintf(stderr,"Joining %d parts\n", k);
+		if (seg_stitch(rx->fd_out, names, k, 
+			       rx->otype == REPLEX_MPEG2) < 0)
+			err = 1;
+	}
+	for (i = 0; i < k; i++){
+		unlink(names[i]);
+		free(names[i]);
+	}
+	// no output that looks complete
+	if (err) unlink(filename);
+	exit(err);
+}
+
+// out.mpg -> out-<number>.mpg
+static char *program_name(char *filename, int number)
+{
+	char *name = malloc(strlen(filename)+16);
+	char *ext = strrchr(filename, '.');
+
+	if (!ext || strchr(ext, '/')) ext = filename+strlen(filename);
+	sprintf(name, "%.*s-%d%s", (int)(ext-filename), filename, number, ext);
+	return name;
+}
+
+static int program_wanted(char *list, int number)
+{
+	char *c = list;
+
+	if (!strcmp(list, "all")) return 1;
+	while (*c){
+		if (strtol(c, &c, 0) == number) return 1;
+		if (*c == ',') c++;
+		else break;
+	}
+	return 0;
 }
 
+/* one child process multiplexes each selected program of the TS,
+   the main process reads the input once and hands each child the
+   packets of its program through a pipe, only the children return */
+static void program_replex(struct replex *rx, char *list, char *filename)
+{
+	uint8_t buf[IN_SIZE+TS_RS_SIZE];
+	ts_psi psi;
+	uint32_t *pidmask;
+	struct iovec *iov[MAX_PROGRAMS];
+	int niov[MAX_PROGRAMS];
+	int fd[MAX_PROGRAMS];
+	pid_t pid[MAX_PROGRAMS];
+	ts_program *prog[MAX_PROGRAMS];
+	int i, j, k = 0;
+	int re, len, c, rest = 0;
+	int skip = -1;
+	int status, err = 0;
+
+	if (!read_psi(rx, &psi, buf)){
+		fprintf(stderr,"No PAT or PMT found\n");
+		exit(1);
+	}
+	rx->finread = 0;
+	rx->lastper = 0;
+	for (i = 0; i < psi.nprog; i++){
+		ts_program *p = &psi.prog[i];
+
+		if (!program_wanted(list, p->number)) continue;
+		if (!p->done || !p->vpid || !(p->apidn || p->ac3n)){
+			fprintf(stderr,"Program %d has no MPEG video or audio\n",
+				p->number);
+			continue;
+		}
+		prog[k++] = p;
+	}
+	if (!k){
+		fprintf(stderr,"No program to multiplex\n");
+		exit(1);
+	}
+	if (!(pidmask = calloc(N_PIDS, sizeof(uint32_t)))){
+		fprintf(stderr,"Not enough memory for programs\n");
+		exit(1);
+	}
+
+	for (i = 0; i < k; i++){
+		ts_program *p = prog[i];
+		char *name = program_name(filename, p->number);
+		int pd[2];
+
+		fprintf(stderr,"Program %d: vpid 0x%04x  %d audio  %d ac3  -> %s\n",
+			p->number, p->vpid, p->apidn, p->ac3n, name);
+		if (!(iov[i] = malloc((IN_SIZE/TS_SIZE+1)*sizeof(struct iovec)))){
+			fprintf(stderr,"Not enough memory for programs\n");
+			exit(1);
+		}
+		if (pipe(pd) < 0){
+			perror("Can't create pipe");
+			exit(1);
+		}
+		if ((pid[i] = fork()) < 0){
+			perror("Can't fork");
+			exit(1);
+		}
+		if (!pid[i]){
+			for (j = 0; j < i; j++) close(fd[j]);
+			close(pd[1]);
+			close(rx->fd_in);
+			rx->fd_in = pd[0];
+			rx->inflength = 0;
+			rx->inputFiles = NULL;
+			rx->use_mmap = 0;
+			// the pipe carries plain 188 byte packets
+			rx->ts_stride = 0;
+
+			rx->vpid = p->vpid;
+			rx->apidn = p->apidn > N_AUDIO ? N_AUDIO : p->apidn;
+			for (j = 0; j < rx->apidn; j++) 
+				rx->apid[j] = p->apid[j];
+			rx->ac3n = p->ac3n > N_AC3 ? N_AC3 : p->ac3n;
+			for (j = 0; j < rx->ac3n; j++) 
+				rx->ac3_id[j] = p->ac3pid[j];
+
+			if ((rx->fd_out = open(name, O_WRONLY|O_CREAT
+					       |O_TRUNC|O_LARGEFILE,
+					       S_IRUSR|S_IWUSR|S_IRGRP|
+					       S_IWGRP|S_IROTH|S_IWOTH)) < 0){
+				perror("Error opening output file");
+				exit(1);
+			}
+			free(name);
+			free(pidmask);
+			return;
+		}
+		close(pd[0]);
+		fd[i] = pd[1];
+		free(name);
+
+		pidmask[p->vpid] |= 1U << i;
+		for (j = 0; j < p->apidn; j++) pidmask[p->apid[j]] |= 1U << i;
+		for (j = 0; j < p->ac3n; j++) pidmask[p->ac3pid[j]] |= 1U << i;
+	}
+	// a child that gives up is noticed at the end
+	signal(SIGPIPE, SIG_IGN);
+
+	while ((re = save_read(rx, buf+rest, IN_SIZE)) > 0){
+		len = rest+re;
+		for (i = 0; i < k; i++) niov[i] = 0;
+
+		// the first packet may not start the file, the last one may
+		// end in the next block
+		if (skip < 0 && !ts_stride(buf, len, &skip)) skip = 0;
+		c = skip;
+		while (c+TS_SIZE <= len){
+			uint32_t m;
+
+			if (buf[c] != 0x47){
+				c++;
+				continue;
+			}
+			m = pidmask[get_pid(buf+c+1)];
+			for (i = 0; m; i++, m >>= 1){
+				struct iovec *v;
+
+				if (!(m & 1)) continue;
+				v = &iov[i][niov[i]-1];
+				if (niov[i] && (uint8_t *)v->iov_base + 
+				    v->iov_len == buf+c)
+					v->iov_len += TS_SIZE;
+				else {
+					v++;
+					v->iov_base = buf+c;
+					v->iov_len = TS_SIZE;
+					niov[i]++;
+				}
+			}
+			c += rx->ts_stride;
+		}
+		skip = 0;
+		if (c > len){
+			skip = c-len;
+			c = len;
+		}
+
+		for (i = 0; i < k; i++)
+			if (fd[i] >= 0 && writev_all(fd[i], iov[i], niov[i]) < 0){
+				close(fd[i]);
+				fd[i] = -1;
+			}
+		rest = len-c;
+		memmove(buf, buf+c, rest);
+	}
+
+	for (i = 0; i < k; i++){
+		if (fd[i] >= 0) close(fd[i]);
+		if (waitpid(pid[i], &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status)){
+			fprintf(stderr,"Program %d failed\n", prog[i]->number);
+			err = 1;
+		}
+		free(iov[i]);
+	}
+	free(pidmask);
+	exit(err);
+}
 
 void do_replex(struct replex *rx)
 {
 	int video_ok = 0;
-	int audio_ok[N_AUDIO];
-	int ac3_ok[N_AC3];
+	uint32_t audio_ok = 0;
+	uint32_t ac3_ok = 0;
 	int start=1;
 	multiplex_t mx;
 	int done = 0;
@@ -2429,8 +3521,7 @@ void do_replex(struct replex *rx)
 
 	fprintf(stderr,"STARTING REPLEX\n");
 	memset(&mx, 0, sizeof(mx));
-	memset(audio_ok, 0, N_AUDIO*sizeof(int));
-	memset(ac3_ok, 0, N_AC3*sizeof(int));
+	mx.ts_rate = rx->ts_rate;
 
 	while (!replex_all_set(rx)){
 		if (replex_fill_buffers(rx, 0)< 0){
@@ -2441,20 +3532,46 @@ void do_replex(struct replex *rx)
 
 	mx.priv = (void *) rx;
 	rx->priv = (void *) &mx;
-	init_multiplex(&mx, &rx->seq_head, rx->aframe, rx->ac3frame, 
-		       rx->apidn, rx->ac3n, rx->video_delay, 
-		       rx->audio_delay, rx->fd_out, fill_buffers,
-		       &rx->vrbuffer, &rx->index_vrbuffer,	
-		       rx->arbuffer, rx->index_arbuffer,
-		       rx->ac3rbuffer, rx->index_ac3rbuffer, rx->otype);
+	if (rx->pipeline && rx->itype == REPLEX_AVI){
+		fprintf(stderr,"No pipelined mode for AVI input\n");
+		rx->pipeline = 0;
+	}
+	if (rx->pipeline && rx->allow_jump){
+		fprintf(stderr,"No pipelined mode with -j\n");
+		rx->pipeline = 0;
+	}
+	if (rx->pipeline && pipe_init(rx) < 0) rx->pipeline = 0;
+
+	if (rx->pipeline){
+		replex_pipe *pp = rx->pipe;
+
+		init_multiplex(&mx, &rx->seq_head, rx->aframe, rx->ac3frame, 
+			       rx->apidn, rx->ac3n, rx->video_delay, 
+			       rx->audio_delay, rx->fd_out, 
+			       pipe_fill_buffers,
+			       &pp->vrbuffer, &pp->index_vrbuffer,	
+			       pp->arbuffer, pp->index_arbuffer,
+			       pp->ac3rbuffer, pp->index_ac3rbuffer, 
+			       rx->otype);
+	} else 
+		init_multiplex(&mx, &rx->seq_head, rx->aframe, rx->ac3frame, 
+			       rx->apidn, rx->ac3n, rx->video_delay, 
+			       rx->audio_delay, rx->fd_out, fill_buffers,
+			       &rx->vrbuffer, &rx->index_vrbuffer,	
+			       rx->arbuffer, rx->index_arbuffer,
+			       rx->ac3rbuffer, rx->index_ac3rbuffer, 
+			       rx->otype);
 
 	if (!rx->ignore_pts){ 
 		fix_audio(rx, &mx);
 	}
+	// shift the part to its place in the whole file
+	if (rx->segment) segment_sync(rx, &mx);
+	if (rx->pipeline && pipe_start(rx) < 0) exit(1);
 	setup_multiplex(&mx);
 
 	do {
-		check_times( &mx, &video_ok, audio_ok, ac3_ok, &start);
+		check_times( &mx, &video_ok, &audio_ok, &ac3_ok, &start);
 
 		write_out_packs( &mx, video_ok, audio_ok, ac3_ok);
 	
@@ -2464,7 +3581,9 @@ void do_replex(struct replex *rx)
 			done=1;
 		}
 	} while (!done);
-	
+	pipe_stop(rx);
+	flush_mpg(&mx);
+	if (rx->segment && seg_failed(rx)) exit(1);
 }
 
 
@@ -2475,7 +3594,9 @@ void usage(char *progname)
         printf ("  --help,             -h            :  print help message\n");
         printf ("\n");
         printf ("  --audio_pid,        -a <integer>  :  audio PID for TS stream (also used for PS id, default 0xc0)\n");
+        printf ("  --pipeline,         -b            :  demux and analyze in a separate thread\n");
         printf ("  --ac3_id,           -c <integer>  :  ID of AC3 audio for demux (also used for PS id, i.e. 0x80)\n");
+        printf ("  --cbr,              -C <integer>  :  constant bit rate in kbit/s with null packets for -t TS (default: VBR)\n");
         printf ("  --video_delay,      -d <integer>  :  video delay in ms\n");
         printf ("  --audio_delay,      -e <integer>  :  audio delay in ms\n");
         printf ("  --ignore_PTS,       -f            :  ignore all PTS information of original\n");
@@ -2484,12 +3605,18 @@ void usage(char *progname)
         printf ("  --allow_jump,       -j            :  allow jump in the PTS and try repair\n");
         printf ("  --keep_PTS,         -k            :  keep and don't correct PTS information of original\n");
 	printf ("  --min_jump,         -l <integer>  :  don't try to fix jumps in PTS larger than <int> but treat them as a cut (default 100ms)\n");
+        printf ("  --mmap,             -m            :  map input files into memory instead of reading them\n");
+        printf ("  --es_threads,       -n            :  analyze each audio stream of a TS in its own thread\n");
         printf ("  --of,               -o <filename> :  set output file\n");
 	printf ("  --fillzero          -p            :  fill audio frames with zeros (only MPEG AUDIO)\n");
+	printf ("  --programs          -P <list>     :  multiplex the TS programs in <list> (i.e. 1,3 or all) into one file each\n");
 	printf ("  --max_overflow      -q <integer>  :  max_number of overflows allowed (default: 100, 0=no restriction)\n");
+        printf ("  --read_ahead,       -r <integer>  :  read <int> MB of input ahead in a separate thread (default 0=off)\n");
         printf ("  --scan,             -s            :  scan for streams\n");
-        printf ("  --type,             -t <string>   :  set output type (string = MPEG2, DVD, HDTV)\n");
+        printf ("  --type,             -t <string>   :  set output type (string = MPEG2, DVD, HDTV, TS)\n");
+        printf ("  --parts,            -u <integer>  :  split a TS file into <int> parts and multiplex them in parallel\n");
         printf ("  --video_pid,        -v <integer>  :  video PID for TS stream (also used for PS id, default 0xe0)\n");
+        printf ("  --direct_io,        -w            :  write the output file with O_DIRECT\n");
         printf ("  --vdr,              -x            :  handle AC3 for vdr input file\n");
         printf ("  --analyze,          -y <integer>  :  analyze (0=video,1=audio, 2=both)\n");
         printf ("  --demux,            -z            :  demux only (-o is basename)\n");
@@ -2507,6 +3634,9 @@ int main(int argc, char **argv)
 	int bufsize = 6*1024*1024;
 	uint64_t min_jump=0;
 	int fillzero = 0;
+	int direct = 0;
+	int parts = 0;
+	char *programs = NULL;
 
 	struct replex rx;
 
@@ -2519,7 +3649,9 @@ int main(int argc, char **argv)
                 int option_index = 0;
                 static struct option long_options[] = {
 			{"audio_pid", required_argument, NULL, 'a'},
+			{"pipeline", no_argument, NULL, 'b'},
 			{"ac3_id", required_argument, NULL, 'c'},
+			{"cbr", required_argument, NULL, 'C'},
 			{"video_delay", required_argument, NULL, 'd'},
 			{"audio_delay", required_argument, NULL, 'e'},
 			{"ignore_PTS",required_argument, NULL, 'f'},
@@ -2529,19 +3661,25 @@ int main(int argc, char **argv)
 			{"allow_jump",required_argument, NULL, 'j'},
 			{"keep_PTS",required_argument, NULL, 'k'},
 			{"min_jump",required_argument, NULL, 'l'},
+			{"mmap",no_argument, NULL, 'm'},
+			{"es_threads",no_argument, NULL, 'n'},
 			{"of",required_argument, NULL, 'o'},
 			{"fillzero",required_argument, NULL, 'p'},
+			{"programs",required_argument, NULL, 'P'},
 			{"max_overflow",required_argument, NULL, 'q'},
+			{"read_ahead",required_argument, NULL, 'r'},
 			{"scan",required_argument, NULL, 's'},
 			{"type", required_argument, NULL, 't'},
+			{"parts", required_argument, NULL, 'u'},
 			{"video_pid", required_argument, NULL, 'v'},
+			{"direct_io",no_argument, NULL, 'w'},
 			{"vdr",required_argument, NULL, 'x'},
 			{"analyze",required_argument, NULL, 'y'},
 			{"demux",no_argument, NULL, 'z'},
 			{0, 0, 0, 0}
 		};
                 c = getopt_long (argc, argv, 
-				 "a:c:d:e:fg:hi:jkl:o:pq:st:v:xy:z",
+				 "a:bc:C:d:e:fg:hi:jkl:mno:pP:q:r:st:u:v:wxy:z",
                                  long_options, &option_index);
                 if (c == -1)
                         break;
@@ -2555,6 +3693,9 @@ int main(int argc, char **argv)
                         rx.apid[rx.apidn] = strtol(optarg,(char **)NULL, 0);
 			rx.apidn++;
                         break;
+		case 'b':
+			rx.pipeline = 1;
+			break;
                 case 'c':
 			if (rx.ac3n==N_AC3){
 				fprintf(stderr,"Too many audio PIDs\n");
@@ -2563,6 +3704,9 @@ int main(int argc, char **argv)
                         rx.ac3_id[rx.ac3n] = strtol(optarg,(char **)NULL, 0);
 			rx.ac3n++;
                         break;
+		case 'C':
+			rx.ts_rate = strtol(optarg,(char **)NULL, 0)*1000;
+			break;
 		case 'd':
 			rx.video_delay = strtol(optarg,(char **)NULL, 0) 
 				*CLOCK_MS;
@@ -2589,24 +3733,42 @@ int main(int argc, char **argv)
 		case 'l':
 			min_jump = strtol(optarg,(char **)NULL, 0) *CLOCK_MS; 
 			break;
+		case 'm':
+			rx.use_mmap = 1;
+			break;
+		case 'n':
+			rx.es_threads = 1;
+			break;
                 case 'o':
                         filename = optarg;
                         break;
 		case 'p':
 			fillzero = 1;
 			break;
+		case 'P':
+			programs = optarg;
+			break;
 		case 'q':
 			rx.max_overflows = strtol(optarg,(char **)NULL, 0); 
 			break;
+		case 'r':
+			rx.read_ahead = strtol(optarg,(char **)NULL, 0); 
+			break;
 		case 's':
 			scan = 1;
 			break;
                 case 't':
                         type = optarg;
                         break;
+		case 'u':
+			parts = strtol(optarg,(char **)NULL, 0); 
+			break;
                 case 'v':
                         rx.vpid = strtol(optarg,(char **)NULL, 0);
                         break;
+		case 'w':
+			direct = 1;
+			break;
 		case 'x':
 			rx.vdr=1;
 			break;
@@ -2626,8 +3788,14 @@ int main(int argc, char **argv)
         }
 
 	if (rx.allow_jump && min_jump) rx.allow_jump = min_jump;
+	if (rx.allow_jump && rx.es_threads){
+		fprintf(stderr,"No analysis threads with -j\n");
+		rx.es_threads = 0;
+	}
 
 	if (fillzero) rx.fillzero = 1;
+	// before any reader or analysis thread can scan for start codes
+	sc_init();
 	rx.inputFiles = NULL;
         if (optind < argc){
 		int i = 0;
@@ -2661,7 +3829,7 @@ int main(int argc, char **argv)
 		rx.inflength = 0;
         }
 
-	if (!rx.demux){
+	if (!rx.demux && !programs){
 		if (filename){
 			if ((rx.fd_out = open(filename,O_WRONLY|O_CREAT
 					      |O_TRUNC|O_LARGEFILE,
@@ -2673,6 +3841,8 @@ int main(int argc, char **argv)
 			}
 			fprintf(stderr,"Output File is: %s\n", 
 				filename);
+			if (direct && set_direct_io(rx.fd_out) < 0)
+				perror("Can't use O_DIRECT for output file");
 		} else {
 			rx.fd_out = STDOUT_FILENO;
 			fprintf(stderr,"using stdout as output\n");
@@ -2693,8 +3863,14 @@ int main(int argc, char **argv)
 		rx.otype=REPLEX_DVD;
 	else if (!strncmp(type,"HDTV",4))
 		rx.otype=REPLEX_HDTV;
+	else if (!strncmp(type,"TS",3))
+		rx.otype=REPLEX_MPEGTS;
         else if (!rx.demux && !analyze)
                 usage(argv[0]);
+	if (rx.ts_rate && rx.otype != REPLEX_MPEGTS){
+		fprintf(stderr,"A constant bit rate needs -t TS\n");
+		exit(1);
+	}
 	
         if (!strncmp(inpt,"TS",3)){
 		rx.itype=REPLEX_TS;
@@ -2715,6 +3891,25 @@ int main(int argc, char **argv)
                 usage(argv[0]);
 	}
 
+	if (parts > 1){
+		if (rx.itype != REPLEX_TS || !rx.inflength || 
+		    rx.inputFiles[1] || !filename || rx.demux || analyze ||
+		    rx.ignore_pts || rx.keep_pts || rx.otype == REPLEX_MPEGTS){
+			fprintf(stderr,"Parts need a single TS file, -o, PS output and no -z, -y, -f or -k\n");
+			exit(1);
+		}
+		segment_replex(&rx, parts, filename);
+	}
+
+	if (programs){
+		if (rx.itype != REPLEX_TS || !rx.inflength || !filename || 
+		    rx.demux || analyze || parts > 1){
+			fprintf(stderr,"Programs need a TS file, -o and no -z, -y or -u\n");
+			exit(1);
+		}
+		program_replex(&rx, programs, filename);
+	}
+
 	init_replex(&rx, bufsize);
 	rx.analyze= analyze;
 
@@ -36,8 +36,92 @@
 #include "ringbuffer.h"
 #include "avi.h"
 #include "multiplex.h"
+#include "reader.h"
+#include "segment.h"
 
 enum { S_SEARCH, S_FOUND, S_ERROR };
+
+/* where a part of a split file starts: the PTS of its first video
+   frame and of the first frame of every audio stream, with a sum of
+   the bytes of that frame, 0 if it has none */
+typedef struct seg_times_s {
+	uint64_t vpts;
+	uint64_t apts[N_AUDIO];
+	uint64_t ac3pts[N_AC3];
+	uint32_t asum[N_AUDIO];
+	uint32_t ac3sum[N_AC3];
+} seg_times;
+
+/* pipelined mode: the demux thread works on copies of the ring
+   buffers and hands finished chunks to the multiplexer by publishing
+   their write positions */
+#define PIPE_DEPTH 4
+#define PIPE_RINGS (2*(1+N_AUDIO+N_AC3))
+typedef struct replex_pipe_s {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int stop;
+	int eof;
+	int request;
+
+	int nrings;
+	ringbuffer *ring[PIPE_RINGS];
+	ringbuffer *view[PIPE_RINGS];
+	int rpos[PIPE_RINGS];
+
+	int wpos[PIPE_DEPTH][PIPE_RINGS];
+	int last[PIPE_DEPTH];
+	int chead;
+	int ccount;
+
+// the multiplexer's side of the ring buffers
+	ringbuffer vrbuffer;
+	ringbuffer index_vrbuffer;
+	ringbuffer arbuffer[N_AUDIO];
+	ringbuffer index_arbuffer[N_AUDIO];
+	ringbuffer ac3rbuffer[N_AC3];
+	ringbuffer index_ac3rbuffer[N_AC3];
+} replex_pipe;
+
+/* per stream analysis: the TS packets of a chunk are sorted by
+   stream and every audio stream is analyzed in its own thread while
+   the demux thread takes care of the video */
+struct replex;
+typedef struct replex_worker_s {
+	pthread_t thread;
+	struct replex *rx;
+	struct replex_workers_s *ws;
+	uint8_t **pkt;
+	int npkt;
+	int gen;
+} replex_worker;
+
+typedef struct replex_workers_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done;
+	int gen;
+	int pending;
+	int stop;
+	int nworkers;
+	uint8_t **vpkt;
+	int nvpkt;
+	replex_worker w[N_AUDIO+N_AC3];
+} replex_workers;
+
+// the packets of a TS block that belong to our streams
+typedef struct ts_batch_s {
+	uint8_t **pkt;
+	pes_in_t **pes;
+	int n;
+	uint64_t packets;
+	uint64_t sync_err;
+	uint64_t trans_err;
+	uint64_t scrambled;
+} ts_batch;
+
 #define MIN_JUMP 100*CLOCK_MS;
 #define MAXFRAME 2000
 
@@ -47,6 +131,7 @@ struct replex {
 #define REPLEX_AVI 2
 	int itype;
 	int otype;
+	uint32_t ts_rate;
 	int ignore_pts; 
 	int keep_pts;
 	uint64_t allow_jump;
@@ -56,6 +141,23 @@ struct replex {
 	int avi_rest;
 	int avi_vcount;
 	int fd_in;
+	int read_ahead;
+	reader_t reader;
+	int use_mmap;
+	inmap_t inmap;
+	int pipeline;
+	replex_pipe *pipe;
+	int es_threads;
+	replex_workers *workers;
+	int segment;
+	int seg_in;
+	int seg_out;
+	int seg_cut;
+	seg_times seg_end;
+	int seg_vdone;
+	int seg_adone[N_AUDIO];
+	int seg_ac3done[N_AC3];
+	int seg_err;
 	int fd_out;
 	int finish;
 	int demux;
@@ -115,6 +217,11 @@ struct replex {
 
 //mpeg video
         uint16_t vpid;
+	int ts_stride;
+	pes_in_t *pid_pes[N_PIDS];
+	ts_psi psi;
+	int psi_count;
+	ts_batch batch;
 	int first_iframe;
 	pes_in_t pvideo;
 	index_unit current_vindex;
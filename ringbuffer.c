@@ -26,18 +26,61 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "ringbuffer.h"
 #include "pes.h"
 
 #define DEBUG 1
+
+/* maps the same memory twice back to back, so that every window of
+   up to size bytes is contiguous, size must be a multiple of the page
+   size */
+static uint8_t *mirror_alloc(int size)
+{
+#ifdef MFD_CLOEXEC
+	uint8_t *mem;
+	int fd;
+
+	if (size % sysconf(_SC_PAGESIZE)) return NULL;
+	if ((fd = memfd_create("ringbuffer", MFD_CLOEXEC)) < 0) return NULL;
+	if (ftruncate(fd, size) < 0){
+		close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, 2*(size_t)size, PROT_NONE, 
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED){
+		close(fd);
+		return NULL;
+	}
+	if (mmap(mem, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, 
+		 fd, 0) == MAP_FAILED ||
+	    mmap(mem+size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+		 fd, 0) == MAP_FAILED){
+		munmap(mem, 2*(size_t)size);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	return mem;
+#else
+	return NULL;
+#endif
+}
+
 // Initialize buffer
 int ring_init (ringbuffer *rbuf, int size)
 {
 	if (size > 0){
 		rbuf->size = size;
-		if( !(rbuf->buffer = (uint8_t *) malloc(sizeof(uint8_t)*size)) ){
+		rbuf->mirror = 0;
+		if ((rbuf->buffer = mirror_alloc(size))){
+			rbuf->mirror = 1;
+		} else if( !(rbuf->buffer = (uint8_t *) malloc(sizeof(uint8_t)*size)) ){
 			fprintf(stderr,"Not enough memory for ringbuffer\n");
 			return -1;
 		}
@@ -61,7 +104,10 @@ void ring_clear(ringbuffer *rbuf)
 // delete buffer
 void ring_destroy(ringbuffer *rbuf)
 {
-	free(rbuf->buffer);
+	if (rbuf->mirror)
+		munmap(rbuf->buffer, 2*(size_t)rbuf->size);
+	else
+		free(rbuf->buffer);
 }
 
 
@@ -86,7 +132,10 @@ int ring_write(ringbuffer *rbuf, uint8_t *data, int count)
 		}
 	}
 	
-	if (count >= rest){
+	if (rbuf->mirror){
+		memcpy (rbuf->buffer+pos, data, count);
+		rbuf->write_pos = (pos + count) % rbuf->size;
+	} else if (count >= rest){
 		memcpy (rbuf->buffer+pos, data, rest);
 		if (count - rest)
 			memcpy (rbuf->buffer, data+rest, count - rest);
@@ -119,7 +168,7 @@ int ring_peek(ringbuffer *rbuf, uint8_t *data, int count, long off)
 		return EMPTY_BUFFER;
 	}
 
-	if ( count < rest ){
+	if ( count < rest || rbuf->mirror){
 		memcpy(data, rbuf->buffer+pos, count);
 	} else {
 		memcpy(data, rbuf->buffer+pos, rest);
@@ -130,6 +179,23 @@ int ring_peek(ringbuffer *rbuf, uint8_t *data, int count, long off)
 	return count;
 }
 
+/* like ring_peek, but returns a pointer to the data in the buffer
+   when it is contiguous and only copies to data otherwise, without
+   data it returns NULL for a split window */
+uint8_t *ring_peek_ptr(ringbuffer *rbuf, uint8_t *data, int count, long off)
+{
+	int pos;
+
+	if (count <=0 || off+count > rbuf->size || off+count >ring_avail(rbuf)) return NULL;
+	pos  = (rbuf->read_pos+off)%rbuf->size;
+
+	if ( pos + count <= rbuf->size || rbuf->mirror)
+		return rbuf->buffer+pos;
+
+	if (!data || ring_peek(rbuf, data, count, off) < 0) return NULL;
+	return data;
+}
+
 
 //read from buffer
 int ring_read(ringbuffer *rbuf, uint8_t *data, int count)
@@ -151,6 +217,9 @@ int ring_read(ringbuffer *rbuf, uint8_t *data, int count)
 	if ( count < rest ){
 		memcpy(data, rbuf->buffer+pos, count);
 		rbuf->read_pos += count;
+	} else if (rbuf->mirror){
+		memcpy(data, rbuf->buffer+pos, count);
+		rbuf->read_pos = count - rest;
 	} else {
 		memcpy(data, rbuf->buffer+pos, rest);
 		if ( count - rest)
@@ -264,6 +333,27 @@ int ring_read_file(ringbuffer *rbuf, int fd, int count)
 	return rr;
 }
 
+// point iov at count bytes starting at off without reading them
+int ring_iov(ringbuffer *rbuf, struct iovec *iov, int count, long off)
+{
+
+	int pos, rest;
+
+	if (count <=0 || off+count > ring_avail(rbuf)) return -1;
+	pos  = (rbuf->read_pos+off)%rbuf->size;
+	rest = rbuf->size - pos;
+
+	iov[0].iov_base = rbuf->buffer+pos;
+	if (count > rest && !rbuf->mirror){
+		iov[0].iov_len = rest;
+		iov[1].iov_base = rbuf->buffer;
+		iov[1].iov_len = count - rest;
+		return 2;
+	}
+	iov[0].iov_len = count;
+	return 1;
+}
+
 // print memory 
 static void show(uint8_t *buf, int length)
 {
@@ -327,11 +417,11 @@ void ring_show(ringbuffer *rbuf, int count, long off)
 int dummy_init(dummy_buffer *dbuf, int s)
 {
 	dbuf->size = s;
-	dbuf->fill = 0;
-	if (ring_init(&dbuf->time_index, DBUF_INDEX*sizeof(uint64_t)) < 0)
-		return -1;
-	if (ring_init(&dbuf->data_index, DBUF_INDEX*sizeof(int32_t)) < 0)
+	dummy_clear(dbuf);
+	if (!(dbuf->unit = malloc(DBUF_INDEX*sizeof(dummy_unit)))){
+		fprintf(stderr,"Not enough memory for buffer model\n");
 		return -1;
+	}
 
 	return 0;
 }
@@ -339,49 +429,67 @@ int dummy_init(dummy_buffer *dbuf, int s)
 void dummy_clear(dummy_buffer *dbuf)
 {
 	dbuf->fill = 0;
-	ring_clear(&dbuf->time_index);
-	ring_clear(&dbuf->data_index);
+	dbuf->peak = 0;
+	dbuf->first = 0;
+	dbuf->n = 0;
+}
+
+/* the time after which dummy_delete leaves more than size bytes 
+   free, -1 if the units in the buffer are not enough */
+int dummy_room(dummy_buffer *dbuf, uint32_t size, uint64_t *time)
+{
+	uint32_t space = dummy_space(dbuf);
+	int first = dbuf->first;
+	int n = dbuf->n;
+
+	if (space > size || !n) return -1;
+	*time = dbuf->unit[first].time;
+	while (n && space <= size){
+		if (ptscmp(dbuf->unit[first].time, *time) > 0)
+			*time = dbuf->unit[first].time;
+		space += dbuf->unit[first].size;
+		if (++first == DBUF_INDEX) first = 0;
+		n--;
+	}
+	if (space <= size) return -1;
+	return 0;
 }
 
 int dummy_add(dummy_buffer *dbuf, uint64_t time, uint32_t size)
 {
+	dummy_unit *u;
+	int pos;
+
 	if (dummy_space(dbuf) < size) return -1;
-//	fprintf(stderr,"add %d ",dummy_space(dbuf));    
+	if (dbuf->n == DBUF_INDEX) return -2;
+
+	pos = dbuf->first + dbuf->n;
+	if (pos >= DBUF_INDEX) pos -= DBUF_INDEX;
+	u = &dbuf->unit[pos];
+	u->time = time;
+	u->size = size;
+	dbuf->n++;
 	dbuf->fill += size;
-	if (ring_write(&dbuf->time_index, (uint8_t *)&time, sizeof(uint64_t)) < 0) 
-		return -2;
-	if (ring_write(&dbuf->data_index, (uint8_t *)&size, sizeof(uint32_t)) < 0) 
-		return -3;
-//	fprintf(stderr," - %d = ",size);    
-//	fprintf(stderr,"%d\n",dummy_space(dbuf));    
+	if (dbuf->fill > dbuf->peak) dbuf->peak = dbuf->fill;
 	return size;
 }
 
+// remove all units that are due before time
 int dummy_delete(dummy_buffer *dbuf, uint64_t time)
 {
-	uint64_t rtime;
-	uint32_t size;
-	int ex=0;
 	uint32_t dsize=0;
-
-	do {
-		if (ring_peek(&dbuf->time_index,(uint8_t *) &rtime, 
-			      sizeof(uint64_t), 0)<0){
-			if (dsize) break;
-			else return -1;
-		}
-		if (ptscmp(rtime,time) < 0){
-			ring_read(&dbuf->time_index,(uint8_t *) &rtime, 
-				  sizeof(uint64_t));
-			ring_read(&dbuf->data_index,(uint8_t *) &size, 
-				  sizeof(uint32_t));
-			dsize += size;
-		} else ex = 1;
-	} while (!ex);
-//	fprintf(stderr,"delete %d ",dummy_space(dbuf));    
+	int first = dbuf->first;
+	int n = dbuf->n;
+
+	if (!n) return -1;
+	while (n && ptscmp(dbuf->unit[first].time, time) < 0){
+		dsize += dbuf->unit[first].size;
+		if (++first == DBUF_INDEX) first = 0;
+		n--;
+	}
+	dbuf->first = first;
+	dbuf->n = n;
 	dbuf->fill -= dsize;
-//	fprintf(stderr," + %d = ",dsize);    
-//	fprintf(stderr,"%d\n",dummy_space(dbuf));    
 
 	return dsize;
 }
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -43,16 +44,26 @@ extern "C" {
 		int write_pos;
 		int size;
 		uint8_t *buffer;
+		int mirror;
 	} ringbuffer;
 
 
 #define DBUF_INDEX 1000
 
+	/* decoder buffer model: the units that are in the buffer with
+	   the time they are removed */
+	typedef struct dummy_unit_s {
+		uint64_t time;
+		uint32_t size;
+	} dummy_unit;
+
 	typedef struct dummy_buffer_s {
 		uint32_t size;
 		uint32_t fill;
-		ringbuffer time_index;
-		ringbuffer data_index;
+		uint32_t peak;
+		int first;
+		int n;
+		dummy_unit *unit;
 	} dummy_buffer;
 
 
@@ -65,6 +76,8 @@ extern "C" {
 	int ring_read_file(ringbuffer *rbuf, int fd, int count);
 	int ring_peek(ringbuffer *rbuf, uint8_t *data, int count, long off);
 	int ring_skip(ringbuffer *rbuf, int count);
+	int ring_iov(ringbuffer *rbuf, struct iovec *iov, int count, long off);
+	uint8_t *ring_peek_ptr(ringbuffer *rbuf, uint8_t *data, int count, long off);
 
 	static inline int ring_wpos(ringbuffer *rbuf)
 	{
@@ -114,8 +127,15 @@ extern "C" {
 	{
 		return (dbuf->size - dbuf->fill);
 	}
+
+	// highest fill the buffer had
+	static inline uint32_t dummy_peak(dummy_buffer *dbuf)
+	{
+		return dbuf->peak;
+	}
 	int dummy_delete(dummy_buffer *dbuf, uint64_t time);
 	int dummy_add(dummy_buffer *dbuf, uint64_t time, uint32_t size);
+	int dummy_room(dummy_buffer *dbuf, uint32_t size, uint64_t *time);
 	void dummy_clear(dummy_buffer *dbuf);
 	int dummy_init(dummy_buffer *dbuf, int s);
 	void ring_show(ringbuffer *rbuf, int count, long off);
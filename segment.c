@@ -0,0 +1,697 @@
+/*
+ * segment.c: split a TS into parts and stitch the multiplexed parts
+ *
+ *
+ * Copyright (C) 2003 - 2006
+ *                    Marcus Metzler <mocm [at] mocm.de>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * General Public License for more details.
+ *
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ * Or, point your browser to http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "segment.h"
+#include "ts.h"
+#include "pes.h"
+#include "element.h"
+#include "mpg_common.h"
+
+#define PACK_SIZE 2048
+
+static ssize_t pread_all(int fd, uint8_t *buf, size_t count, uint64_t pos)
+{
+	ssize_t neof = 1;
+	size_t re = 0;
+
+	while(re < count){
+		neof = pread(fd, buf+re, count - re, pos+re);
+		if (neof > 0) re += neof;
+		else if (neof < 0 && errno == EINTR) continue;
+		else break;
+	}
+	if (neof < 0 && re == 0) return neof;
+	return re;
+}
+
+static int write_all(int fd, uint8_t *buf, int count)
+{
+	int w, written = 0;
+
+	while (written < count){
+		w = write(fd, buf+written, count-written);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return -1;
+		written += w;
+	}
+	return written;
+}
+
+// does the packet start a video PES with a sequence header?
+static int seq_start(uint8_t *tsp, uint16_t vpid)
+{
+	int off = 4;
+	int i;
+
+	if (tsp[0] != 0x47 || !(tsp[1] & PAY_START) || get_pid(tsp+1) != vpid)
+		return 0;
+	if (tsp[3] & ADAPT_FIELD) off += tsp[4] + 1;
+
+	for (i = off; i < TS_SIZE-3; i++)
+		if (!tsp[i] && !tsp[i+1] && tsp[i+2] == 0x01 && 
+		    tsp[i+3] == 0xB3)
+			return 1;
+	return 0;
+}
+
+/* looks for the first sequence header at or after pos, returns its
+   packet offset or length if there is none */
+static uint64_t find_seq(int fd, uint64_t length, uint16_t vpid, 
+			 uint64_t pos, int stride, uint8_t *buf)
+{
+	ssize_t re;
+	int i;
+
+	while (pos < length){
+		if ((re = pread_all(fd, buf, SEG_BLOCK, pos)) < TS_SIZE)
+			break;
+		for (i = 0; i+TS_SIZE <= re; i += stride){
+			if (buf[i] != 0x47){
+				fprintf(stderr,"Lost TS sync while splitting\n");
+				return length;
+			}
+			if (seq_start(buf+i, vpid)) return pos+i;
+		}
+		pos += i;
+	}
+	return length;
+}
+
+/* fills off[0..n] with the boundaries of at most n parts of the file,
+   every part but the first starts with a sequence header */
+int seg_split(int fd, uint64_t length, uint16_t vpid, int n, uint64_t *off)
+{
+	uint8_t *buf;
+	uint64_t pos;
+	ssize_t re;
+	int i, k;
+	int start, stride;
+
+	if (!(buf = malloc(SEG_BLOCK))){
+		fprintf(stderr,"Not enough memory for splitting\n");
+		return -1;
+	}
+	if ((re = pread_all(fd, buf, 4*TS_RS_SIZE, 0)) < 2*TS_SIZE){
+		free(buf);
+		return -1;
+	}
+	if (!(stride = ts_stride(buf, re, &start)) || start >= stride){
+		fprintf(stderr,"Not a TS\n");
+		free(buf);
+		return -1;
+	}
+
+	off[0] = 0;
+	k = 1;
+	for (i = 1; i < n; i++){
+		pos = length/n*i;
+		pos -= (pos - start) % stride;
+		if (pos <= off[k-1]) continue;
+		pos = find_seq(fd, length, vpid, pos, stride, buf);
+		if (pos >= length) break;
+		if (pos <= off[k-1]) continue;
+		off[k++] = pos;
+	}
+	off[k] = length;
+	free(buf);
+
+	return k;
+}
+
+static uint64_t get_scr(uint8_t *p)
+{
+	uint64_t base;
+	int ext;
+
+	base = ((uint64_t)(p[0] & 0x38) << 27) | ((p[0] & 0x03) << 28) |
+		(p[1] << 20) | ((p[2] & 0xF8) << 12) | ((p[2] & 0x03) << 13) |
+		(p[3] << 5) | (p[4] >> 3);
+	ext = ((p[4] & 0x03) << 7) | (p[5] >> 1);
+
+	return base*300ULL + ext;
+}
+
+static void set_scr(uint8_t *p, uint64_t SCR)
+{
+	uint8_t buf[PACK_SIZE];
+
+	// same encoding as the multiplexer
+	write_ps_header(buf, SCR, 0, 0, 0, 0, 1, 1, 1, 0);
+	memcpy(p, buf+4, 6);
+}
+
+static uint32_t get_muxr(uint8_t *p)
+{
+	return ((p[0] << 14) | (p[1] << 6) | (p[2] >> 2))*50;
+}
+
+static int is_pack(uint8_t *p)
+{
+	return !p[0] && !p[1] && p[2] == 0x01 && p[3] == 0xBA;
+}
+
+#define SEG_VIDEO   1
+#define SEG_MPA     2
+#define SEG_AC3     3
+#define SEG_STREAMS 64
+// stream ids and AC3 sub ids of the packs
+#define SEG_KEYS    512
+// video bytes kept for start codes that span two PES
+#define SEG_CARRY   11
+// temporal references of a GOP that are checked
+#define SEG_GOP     128
+
+// one stream of the stitched output as a demultiplexer sees it
+typedef struct seg_es_s {
+	int      id;
+	int      type;
+	uint64_t next;
+	uint64_t dur;
+	uint64_t period;
+	uint64_t ts;
+	int      ts_set;
+	int      set;
+	int      seam;
+	int      part;
+	int      skip;
+	uint8_t  hdr[SEG_CARRY];
+	int      hl;
+	// video: the pictures of the current GOP in display order
+	uint32_t gdur[SEG_GOP];
+	int      pics;
+	int      gop_bad;
+	int      gop_seam;
+	int      anchor;
+	int      atr;
+	uint64_t apts;
+	int      pic;
+	int      ptr;
+	uint64_t pdur;
+} seg_es;
+
+typedef struct seg_check_s {
+	seg_es es[SEG_STREAMS];
+	int n;
+	int part;
+	int err;
+} seg_check;
+
+// frame periods of the MPEG video frame rate codes
+static const uint64_t frame_period[16] = {
+	0, 1126125, 1125000, 1080000, 900900, 900000, 540000, 450450, 450000
+};
+
+static seg_es *get_es(seg_check *c, int id, int type)
+{
+	int i;
+
+	for (i = 0; i < c->n; i++)
+		if (c->es[i].id == id) return &c->es[i];
+	if (c->n == SEG_STREAMS) return NULL;
+	c->es[c->n].id = id;
+	c->es[c->n].type = type;
+	return &c->es[c->n++];
+}
+
+static void es_off(seg_check *c, seg_es *es, uint64_t ts, uint64_t dur)
+{
+	int64_t diff = ptsdiff(ts, es->next);
+
+	if (diff > (int64_t)dur || -diff > (int64_t)dur){
+		fprintf(stderr,"Part %d: stream 0x%02x is off by %d ms at "
+			"the start\n", c->part, es->id & 0xFF, 
+			(int)(diff/(int64_t)CLOCK_MS));
+		c->err = 1;
+	}
+}
+
+/* an audio frame starts, ts tells whether the timestamp of its PES
+   belongs to it, the first timestamp of a part has to follow the
+   frames of the part before within one frame */
+static void es_frame(seg_check *c, seg_es *es, uint64_t dur, int ts)
+{
+	if (es->set) es->next = (es->next + es->dur) % MAX_PTS2;
+	if (ts && es->ts_set){
+		if (es->set && es->seam) es_off(c, es, es->ts, es->dur);
+		es->next = es->ts;
+		es->set = 1;
+		es->seam = 0;
+		es->ts_set = 0;
+	}
+	es->dur = dur;
+}
+
+// the current picture is complete
+static void pic_end(seg_es *es)
+{
+	if (!es->pic) return;
+	es->pic = 0;
+	if (es->ptr >= SEG_GOP){
+		es->gop_bad = 1;
+		return;
+	}
+	es->gdur[es->ptr] += es->pdur;
+	if (es->ptr >= es->pics) es->pics = es->ptr+1;
+}
+
+/* a GOP ends, in display order it starts at the PTS of its first
+   picture with a timestamp less the pictures shown before that one,
+   the first GOP of a part has to start where the GOP before ended
+   within one frame */
+static void gop_end(seg_check *c, seg_es *es)
+{
+	uint64_t before = 0, all = 0;
+	int i;
+
+	pic_end(es);
+	for (i = 0; i < es->pics && es->gdur[i]; i++){
+		if (i < es->atr) before += es->gdur[i];
+		all += es->gdur[i];
+	}
+	if (es->gop_bad || i < es->pics) es->set = 0;
+	else if (es->anchor){
+		uint64_t base = (es->apts + MAX_PTS2 - before) % MAX_PTS2;
+
+		if (es->set && es->gop_seam) es_off(c, es, base, es->period);
+		es->next = (base + all) % MAX_PTS2;
+		es->set = 1;
+	} else if (es->set) es->next = (es->next + all) % MAX_PTS2;
+
+	memset(es->gdur, 0, sizeof(es->gdur));
+	es->pics = 0;
+	es->gop_bad = 0;
+	es->anchor = 0;
+	es->gop_seam = es->seam;
+	es->seam = 0;
+}
+
+/* a picture starts, own tells whether the timestamp of its PES
+   belongs to it */
+static void pic_start(seg_es *es, uint8_t *h, int own)
+{
+	pic_end(es);
+	es->pic = 1;
+	es->ptr = (h[4] << 2) | (h[5] >> 6);
+	es->pdur = es->period;
+	if (own && es->ts_set && !es->anchor){
+		es->anchor = 1;
+		es->atr = es->ptr;
+		es->apts = es->ts;
+	}
+	if (own) es->ts_set = 0;
+}
+
+static void es_video(seg_check *c, seg_es *es, uint8_t *buf, int len)
+{
+	uint8_t w[PACK_SIZE+SEG_CARRY];
+	int pos[PACK_SIZE/3+SEG_CARRY];
+	int i, n, p, wl;
+
+	memcpy(w, es->hdr, es->hl);
+	memcpy(w+es->hl, buf, len);
+	wl = es->hl + len;
+	n = find_start_codes(w, wl, pos, PACK_SIZE/3+SEG_CARRY);
+	for (i = 0; i < n && (p = pos[i]) < wl - SEG_CARRY; i++){
+		switch (w[p+3]){
+		case SEQUENCE_HDR_CODE:
+			es->period = frame_period[w[p+7] & 0x0F];
+			break;
+		case GROUP_START_CODE:
+			gop_end(c, es);
+			break;
+		case PICTURE_START_CODE:
+			pic_start(es, w+p, p+3 >= es->hl);
+			break;
+		case EXTENSION_START_CODE:
+			// picture coding extension: fields and repeat flag
+			if ((w[p+4] >> 4) != PICTURE_CODING_EXTENSION) break;
+			if ((w[p+6] & 0x03) != 0x03) es->pdur = es->period/2;
+			else if (w[p+7] & 0x02) es->pdur = 3*es->period/2;
+			break;
+		}
+	}
+	es->hl = wl < SEG_CARRY ? wl : SEG_CARRY;
+	memcpy(es->hdr, w+wl-es->hl, es->hl);
+}
+
+static int es_audio_header(seg_es *es, audio_frame_t *af)
+{
+	uint8_t *h = es->hdr;
+
+	memset(af, 0, sizeof(audio_frame_t));
+	if (es->type == SEG_AC3){
+		if (h[0] != 0x0B || h[1] != 0x77) return -1;
+		ac3_header_info(h, af, 0);
+	} else if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0 ||
+		   audio_header_info(h, af, 0) < 0) return -1;
+	if ((int)af->framesize <= es->hl || !af->frequency) return -1;
+	return 0;
+}
+
+static void es_audio(seg_check *c, seg_es *es, uint8_t *buf, int len)
+{
+	audio_frame_t af;
+	int need = (es->type == SEG_AC3) ? 6 : 4;
+	int i = 0;
+	int own;
+
+	while (i < len){
+		if (es->skip){
+			int l = es->skip < len-i ? es->skip : len-i;
+
+			es->skip -= l;
+			i += l;
+			continue;
+		}
+		own = !es->hl;
+		while (es->hl < need && i < len) es->hdr[es->hl++] = buf[i++];
+		if (es->hl < need) break;
+		if (es_audio_header(es, &af) < 0){
+			// lost the frames, look for the next header
+			memmove(es->hdr, es->hdr+1, --es->hl);
+			es->set = 0;
+			continue;
+		}
+		es_frame(c, es, add_pts_audio(0, &af, 1), own);
+		es->skip = af.framesize - need;
+		es->hl = 0;
+	}
+}
+
+// demultiplexes the PES of a pack
+static void check_pack(seg_check *c, uint8_t *buf)
+{
+	int pos = 14 + (buf[13] & 0x07);
+
+	while (pos+9 <= PACK_SIZE && !buf[pos] && !buf[pos+1] && 
+	       buf[pos+2] == 0x01){
+		int id = buf[pos+3];
+		int plen = (buf[pos+4] << 8) | buf[pos+5];
+		int hl = buf[pos+8];
+		int len = plen-3-hl;
+		uint8_t *pay = buf+pos+9+hl;
+		seg_es *es = NULL;
+
+		if (pos+6+plen > PACK_SIZE) break;
+		switch (id){
+		case VIDEO_STREAM_S ... VIDEO_STREAM_E:
+			if (len > 0) es = get_es(c, id, SEG_VIDEO);
+			break;
+		case AUDIO_STREAM_S ... AUDIO_STREAM_E:
+			if (len > 0) es = get_es(c, id, SEG_MPA);
+			break;
+		case PRIVATE_STREAM1:
+			if (len > 4 && pay[0] >= 0x80 && pay[0] <= 0x87)
+				es = get_es(c, 0x100 | pay[0], SEG_AC3);
+			pay += 4;
+			len -= 4;
+			break;
+		}
+		if (es){
+			// the first PES of a stream in the next part
+			if (es->part && es->part != c->part) es->seam = 1;
+			es->part = c->part;
+			// the PTS of the first frame that starts in the PES
+			if (buf[pos+7] & 0x80){
+				es->ts = trans_pts_dts(buf+pos+9);
+				es->ts_set = 1;
+			}
+			if (es->type == SEG_VIDEO) es_video(c, es, pay, len);
+			else es_audio(c, es, pay, len);
+		}
+		pos += 6+plen;
+	}
+}
+
+// the packs of a part
+typedef struct seg_src_s {
+	int      fd;
+	int      part;
+	uint8_t  *buf;
+	uint64_t length;
+	uint64_t pos;
+	int      l;
+	int      j;
+} seg_src;
+
+static int src_open(seg_src *s, char *name, int part, int strip_end)
+{
+	if ((s->fd = open(name, O_RDONLY|O_LARGEFILE)) < 0){
+		perror("Error opening part");
+		return -1;
+	}
+	s->length = lseek(s->fd, 0, SEEK_END);
+	// only the last part keeps the end code
+	if (strip_end && s->length % PACK_SIZE == 4) s->length -= 4;
+	s->part = part;
+	s->pos = 0;
+	s->l = 0;
+	s->j = 0;
+	return 0;
+}
+
+// file offset of the current pack
+static uint64_t src_off(seg_src *s)
+{
+	return s->pos + s->j;
+}
+
+/* points p to the current pack and returns its length, 0 at the end
+   of the part */
+static int src_next(seg_src *s, uint8_t **p)
+{
+	if (s->j >= s->l){
+		int l = SEG_BLOCK;
+
+		s->pos += s->l;
+		s->l = 0;
+		s->j = 0;
+		if (s->pos >= s->length) return 0;
+		if (s->length - s->pos < l) l = s->length - s->pos;
+		if (pread_all(s->fd, s->buf, l, s->pos) < l){
+			fprintf(stderr,"Error reading part %d\n", s->part);
+			return -1;
+		}
+		s->l = l;
+	}
+	*p = s->buf + s->j;
+	return (s->l - s->j < PACK_SIZE) ? s->l - s->j : PACK_SIZE;
+}
+
+// the stream of a pack, AC3 by its sub id, -1 if there is none
+static int pack_stream(uint8_t *buf)
+{
+	int pos = 14 + (buf[13] & 0x07);
+
+	while (pos+9 <= PACK_SIZE && !buf[pos] && !buf[pos+1] && 
+	       buf[pos+2] == 0x01){
+		if (buf[pos+3] == PRIVATE_STREAM1 && pos+9+buf[pos+8] < PACK_SIZE)
+			return 0x100 | buf[pos+9+buf[pos+8]];
+		if (buf[pos+3] != SYS_START) return buf[pos+3];
+		pos += 6 + ((buf[pos+4] << 8) | buf[pos+5]);
+	}
+	return -1;
+}
+
+/* offset of the first pack of a part at or after SCR and of the last
+   pack of every stream from there on */
+static int seg_tail(seg_src *s, uint64_t SCR, uint64_t *tail, 
+		    uint64_t *last)
+{
+	uint64_t lo = 0;
+	uint64_t hi = s->length / PACK_SIZE;
+	uint64_t pos;
+	uint8_t *p;
+
+	// the packs of a part are in SCR order
+	while (lo < hi){
+		uint64_t mid = (lo + hi)/2;
+
+		if (pread_all(s->fd, s->buf, PACK_SIZE, mid*PACK_SIZE) 
+		    < PACK_SIZE)
+			return -1;
+		if (is_pack(s->buf) && ptscmp(get_scr(s->buf+4), SCR) < 0)
+			lo = mid+1;
+		else hi = mid;
+	}
+	*tail = lo*PACK_SIZE;
+
+	memset(last, 0, SEG_KEYS*sizeof(uint64_t));
+	for (pos = *tail; pos+PACK_SIZE <= s->length; pos += PACK_SIZE){
+		int k;
+
+		p = s->buf + (pos - *tail) % SEG_BLOCK;
+		if (p == s->buf){
+			int l = SEG_BLOCK;
+
+			if (s->length - pos < l) l = s->length - pos;
+			if (pread_all(s->fd, s->buf, l, pos) < l) return -1;
+		}
+		if (is_pack(p) && (k = pack_stream(p)) >= 0)
+			last[k] = pos + PACK_SIZE;
+	}
+	// the buffer is read again from the current pack
+	s->pos += s->j;
+	s->l = 0;
+	s->j = 0;
+	return 0;
+}
+
+/* appends the parts to fd_out, the tail of a part and the start of
+   the next one are interleaved by SCR with the packs of every stream
+   kept in order, the SCR is only raised where two packs would
+   overlap, and the timestamps at the start of a part are checked
+   against the frames before */
+int seg_stitch(int fd_out, char **names, int n, int strip_end)
+{
+	seg_src src[2];
+	uint8_t *obuf;
+	uint64_t last[SEG_KEYS];
+	uint64_t lastSCR = 0;
+	uint64_t SCRinc = 0;
+	int ol = 0;
+	seg_check chk;
+	int i, l = 0;
+
+	memset(src, 0, sizeof(src));
+	src[0].fd = src[1].fd = -1;
+	if (!(obuf = malloc(SEG_BLOCK)) || 
+	    !(src[0].buf = malloc(SEG_BLOCK)) ||
+	    !(src[1].buf = malloc(SEG_BLOCK))){
+		fprintf(stderr,"Not enough memory for stitching\n");
+		free(obuf);
+		free(src[0].buf);
+		return -1;
+	}
+	memset(&chk, 0, sizeof(chk));
+	// the parts are not aligned for O_DIRECT
+	fcntl(fd_out, F_SETFL, fcntl(fd_out, F_GETFL) & ~O_DIRECT);
+
+	if (src_open(&src[0], names[0], 1, strip_end && n > 1) < 0) l = -1;
+	for (i = 0; i < n && !l; i++){
+		seg_src *cur = &src[i & 1];
+		seg_src *nxt = NULL;
+		uint64_t tail = cur->length;
+		uint8_t *p, *q;
+		int m;
+
+		if (i < n-1){
+			nxt = &src[(i+1) & 1];
+			if (src_open(nxt, names[i+1], i+2, 
+				     strip_end && i+1 < n-1) < 0 ||
+			    (m = src_next(nxt, &q)) < 0){
+				l = -1;
+				break;
+			}
+			if (m == PACK_SIZE && is_pack(q) &&
+			    seg_tail(cur, get_scr(q+4), &tail, last) < 0){
+				fprintf(stderr,"Error reading part %d\n", i+1);
+				l = -1;
+				break;
+			}
+		}
+
+		while ((l = src_next(cur, &p)) > 0){
+			seg_src *s = cur;
+			int k;
+
+			if (nxt && src_off(cur) >= tail && l == PACK_SIZE){
+				if ((m = src_next(nxt, &q)) < 0){
+					l = -1;
+					break;
+				}
+				// the next part may go ahead with the streams
+				// that are done in this one
+				if (m == PACK_SIZE && is_pack(q) && is_pack(p) &&
+				    ptscmp(get_scr(q+4), get_scr(p+4)) < 0 &&
+				    ((k = pack_stream(q)) < 0 || 
+				     last[k] <= src_off(cur))){
+					s = nxt;
+					p = q;
+					l = m;
+				}
+				// both parts fill the time, padding isn't needed
+				if (is_pack(p) && pack_stream(p) == PADDING_STREAM){
+					s->j += l;
+					continue;
+				}
+			}
+			if (l == PACK_SIZE && is_pack(p)){
+				uint64_t SCR = get_scr(p+4);
+				uint32_t muxr = get_muxr(p+10);
+
+				if (SCRinc && ptscmp(SCR, lastSCR+SCRinc) < 0){
+					SCR = lastSCR;
+					ptsinc(&SCR, SCRinc);
+					set_scr(p+4, SCR);
+				}
+				lastSCR = SCR;
+				// never more than the multiplexer's own spacing
+				if (muxr)
+					SCRinc = 27000000ULL*PACK_SIZE/(muxr+50);
+				chk.part = s->part;
+				check_pack(&chk, p);
+			}
+			if (ol + l > SEG_BLOCK){
+				if (write_all(fd_out, obuf, ol) < 0){
+					perror("Error writing output");
+					l = -1;
+					break;
+				}
+				ol = 0;
+			}
+			memcpy(obuf+ol, p, l);
+			ol += l;
+			s->j += l;
+		}
+		close(cur->fd);
+		cur->fd = -1;
+	}
+	if (!l && ol && write_all(fd_out, obuf, ol) < 0){
+		perror("Error writing output");
+		l = -1;
+	}
+	// the last GOPs
+	for (i = 0; i < chk.n; i++)
+		if (chk.es[i].type == SEG_VIDEO) gop_end(&chk, &chk.es[i]);
+	for (i = 0; i < 2; i++)
+		if (src[i].fd >= 0) close(src[i].fd);
+	free(obuf);
+	free(src[0].buf);
+	free(src[1].buf);
+
+	return (l < 0 || chk.err) ? -1 : 0;
+}
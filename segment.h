@@ -0,0 +1,46 @@
+/*
+ * segment.h
+ *
+ *
+ * Copyright (C) 2003 - 2006
+ *                    Marcus Metzler <mocm [at] mocm.de>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * General Public License for more details.
+ *
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ * Or, point your browser to http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#include <stdint.h>
+
+#define MAX_SEGMENTS 64
+#define SEG_BLOCK    (1024*1024)
+// how far a part may read into the next one to reach its end
+#define SEG_OVERLAP  (32*1024*1024)
+// largest audio frame whose bytes are compared at a cut
+#define SEG_FRAME    4096
+
+/* splitting of a TS file at video sequence headers and stitching
+   of the separately multiplexed parts */
+int seg_split(int fd, uint64_t length, uint16_t vpid, int n, uint64_t *off);
+int seg_stitch(int fd_out, char **names, int n, int strip_end);
+
+#endif /*_SEGMENT_H_*/
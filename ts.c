@@ -41,8 +41,33 @@ uint16_t get_pid(uint8_t *pid)
 	return pp;
 }
 
+/* packet size of a TS with plain, timecoded or RS protected packets,
+   start gets the offset of the first sync byte */
+int ts_stride(uint8_t *buf, int len, int *start)
+{
+	int sizes[3] = { TS_SIZE, M2TS_SIZE, TS_RS_SIZE };
+	int c, i;
+
+	for (c = 0; c + TS_SIZE < len; c++){
+		if (buf[c] != 0x47) continue;
+		for (i = 0; i < 3; i++){
+			int s = sizes[i];
+
+			if (c+s >= len || buf[c+s] != 0x47) continue;
+			if (c+2*s < len && buf[c+2*s] != 0x47) continue;
+			if (start) *start = c;
+			return s;
+		}
+	}
+	return 0;
+}
+
+/* header and adaptation field of a packet with length bytes of
+   payload, the adaptation field carries the PCR if pcr is given
+   (length is at most TS_SIZE-12 then) and is stuffed up to the
+   payload, a packet without payload keeps the continuity counter */
 int write_ts_header(uint16_t pid, uint8_t *counter, int pes_start, 
-		    uint8_t *buf, uint8_t length)
+		    uint8_t *buf, uint8_t length, uint64_t *pcr)
 {
 	int i;
 	int c = 0;
@@ -53,9 +78,11 @@ int write_ts_header(uint16_t pid, uint8_t *counter, int pes_start,
 	fill = TS_SIZE-4-length;
         if (pes_start) tshead[1] = 0x40;
 	if (fill) tshead[3] = 0x30;
+	if (!length) tshead[3] = 0x20;
         tshead[1] |= (uint8_t)((pid & 0x1F00) >> 8);
         tshead[2] |= (uint8_t)(pid & 0x00FF);
-        tshead[3] |= ((*counter)++ & 0x0F) ;
+	if (length) tshead[3] |= ((*counter)++ & 0x0F);
+	else tshead[3] |= ((*counter)-1) & 0x0F;
         memcpy(buf,tshead,4);
 	c+=4;
 
@@ -67,7 +94,21 @@ int write_ts_header(uint16_t pid, uint8_t *counter, int pes_start,
 			buf[5] = 0x00;
 			c++;
 		}
-		for ( i = 6; i < fill+4; i++){
+		if (pcr && fill >= 8){
+			uint64_t base = *pcr/300ULL;
+			uint16_t ext = *pcr%300ULL;
+
+			buf[5] = PCR_FLAG;
+			buf[6] = (uint8_t)(base >> 25);
+			buf[7] = (uint8_t)(base >> 17);
+			buf[8] = (uint8_t)(base >> 9);
+			buf[9] = (uint8_t)(base >> 1);
+			buf[10] = (uint8_t)(((base & 1) << 7) | 0x7E | 
+					    (ext >> 8));
+			buf[11] = (uint8_t)(ext & 0xFF);
+			c += 6;
+		}
+		for ( i = c; i < fill+4; i++){
 			buf[i] = 0xFF;
 			c++;
 		}
@@ -77,7 +118,7 @@ int write_ts_header(uint16_t pid, uint8_t *counter, int pes_start,
 }
 
 
-int find_pids_pos(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf, int len, int *vpos, int *apos, int *ac3pos)
+int find_pids_pos(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf, int len, int stride, int *vpos, int *apos, int *ac3pos)
 {
 	int c=0;
 	int found=0;
@@ -88,8 +129,8 @@ int find_pids_pos(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf,
 	*apid = 0;
 	*ac3pid = 0;
 
-	while ( c+TS_SIZE < len){
-		if (buf[c] == buf[c+TS_SIZE]) break;
+	while ( c+stride < len){
+		if (buf[c] == buf[c+stride]) break;
 		c++;
 	}
 
@@ -141,13 +182,363 @@ int find_pids_pos(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf,
 				}
 			}
 		} 
-		c+= TS_SIZE;
+		c+= stride;
 	}
 	return found;
 }
 
 
-int find_pids(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf, int len)
+int find_pids(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf, int len, int stride)
+{
+	return find_pids_pos(vpid, apid, ac3pid, buf, len, stride, 
+			     NULL, NULL, NULL);
+}
+
+
+static uint32_t psi_crc32(uint8_t *buf, int len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	int i, j;
+
+	for (i = 0; i < len; i++){
+		crc ^= (uint32_t)buf[i] << 24;
+		for (j = 0; j < 8; j++)
+			crc = (crc << 1) ^ ((crc & 0x80000000) ? 0x04C11DB7 : 0);
+	}
+	return crc;
+}
+
+/* collects the section that starts in a packet with the payload unit
+   start flag, returns its length once it is complete */
+static int section_add(ts_section *s, uint8_t *buf, int len, int start)
+{
+	int l;
+
+	if (start){
+		if (1+buf[0] >= len){
+			s->len = 0;
+			return 0;
+		}
+		len -= 1+buf[0];
+		buf += 1+buf[0];
+		s->len = 0;
+	} else if (!s->len) return 0;
+
+	if (s->len + len > MAX_SECTION) len = MAX_SECTION - s->len;
+	memcpy(s->buf+s->len, buf, len);
+	s->len += len;
+	if (s->len < 3) return 0;
+
+	l = 3 + (((s->buf[1] & 0x0F) << 8) | s->buf[2]);
+	if (s->buf[0] == 0xFF || l > MAX_SECTION || l < 12){
+		s->len = 0;
+		return 0;
+	}
+	if (s->len < l) return 0;
+	s->len = 0;
+	if (psi_crc32(s->buf, l)) return 0;
+
+	return l;
+}
+
+static ts_program *find_program(ts_psi *psi, uint16_t number)
+{
+	int i;
+
+	for (i = 0; i < psi->nprog; i++)
+		if (psi->prog[i].number == number) return &psi->prog[i];
+	return NULL;
+}
+
+static void parse_pat(ts_psi *psi, uint8_t *buf, int len)
 {
-	return find_pids_pos(vpid, apid, ac3pid, buf, len, NULL, NULL, NULL);
+	int c, i;
+	int sn = buf[6];
+
+	if (buf[0] != PAT_TABLE || !(buf[5] & 0x01)) return;
+	if (psi->pat_seen[sn/8] & (1 << (sn%8))) return;
+	psi->pat_seen[sn/8] |= 1 << (sn%8);
+	psi->pat_last = buf[7];
+
+	for (c = 8; c+4 <= len-4; c += 4){
+		uint16_t number = (buf[c] << 8) | buf[c+1];
+		ts_program *p;
+
+		if (!number || find_program(psi, number)) continue; // NIT
+		if (psi->nprog == MAX_PROGRAMS) break;
+		p = &psi->prog[psi->nprog++];
+		memset(p, 0, sizeof(ts_program));
+		p->number = number;
+		p->pmt_pid = get_pid(buf+c+2);
+	}
+
+	for (i = 0; i <= psi->pat_last; i++)
+		if (!(psi->pat_seen[i/8] & (1 << (i%8)))) return;
+	psi->pat_done = 1;
+}
+
+static int has_desc(uint8_t *buf, int len, uint8_t tag)
+{
+	int c = 0;
+
+	while (c+2 <= len){
+		if (buf[c] == tag) return 1;
+		c += 2 + buf[c+1];
+	}
+	return 0;
+}
+
+static void parse_pmt(ts_psi *psi, uint8_t *buf, int len)
+{
+	ts_program *p;
+	int c;
+
+	if (buf[0] != PMT_TABLE || !(buf[5] & 0x01)) return;
+	if (!(p = find_program(psi, (buf[3] << 8) | buf[4])) || p->done)
+		return;
+
+	p->pcr_pid = get_pid(buf+8);
+	c = 12 + (((buf[10] & 0x0F) << 8) | buf[11]);
+	while (c+5 <= len-4){
+		uint16_t pid = get_pid(buf+c+1);
+		int il = ((buf[c+3] & 0x0F) << 8) | buf[c+4];
+
+		if (c+5+il > len-4) break;
+		switch(buf[c]){
+		case 0x01: // MPEG-1 and MPEG-2 video
+		case 0x02:
+			if (!p->vpid) p->vpid = pid;
+			break;
+
+		case 0x03: // MPEG-1 and MPEG-2 audio
+		case 0x04:
+			if (p->apidn < MAX_PSTREAMS) p->apid[p->apidn++] = pid;
+			break;
+
+		case 0x06: // private PES, AC3 has a descriptor
+			if (!has_desc(buf+c+5, il, AC3_DESC)) break;
+			// fall through
+		case 0x81: // ATSC AC3
+			if (p->ac3n < MAX_PSTREAMS) p->ac3pid[p->ac3n++] = pid;
+			break;
+		}
+		c += 5 + il;
+	}
+	p->done = 1;
+}
+
+void ts_psi_init(ts_psi *psi)
+{
+	memset(psi, 0, sizeof(ts_psi));
+}
+
+int ts_psi_done(ts_psi *psi)
+{
+	int i;
+
+	if (!psi->pat_done) return 0;
+	for (i = 0; i < psi->nprog; i++)
+		if (!psi->prog[i].done) return 0;
+	return 1;
+}
+
+// returns 1 once the PAT and all PMTs are known
+int ts_psi_packet(ts_psi *psi, uint8_t *tsp)
+{
+	uint16_t pid = get_pid(tsp+1);
+	ts_section *s = NULL;
+	uint8_t *buf;
+	int off = 4;
+	int i, l, len;
+
+	if (tsp[0] != 0x47 || (tsp[1] & TRANS_ERROR) || !(tsp[3] & PAYLOAD))
+		return ts_psi_done(psi);
+
+	if (pid == PAT_PID){
+		if (!psi->pat_done) s = &psi->pat;
+	} else {
+		// programs may share a PMT PID, the first one collects
+		for (i = 0; i < psi->nprog; i++)
+			if (psi->prog[i].pmt_pid == pid && !psi->prog[i].done){
+				s = &psi->prog[i].sec;
+				break;
+			}
+	}
+	if (!s) return ts_psi_done(psi);
+
+	if (tsp[3] & ADAPT_FIELD) off += tsp[4] + 1;
+	if (off >= TS_SIZE) return ts_psi_done(psi);
+
+	buf = tsp+off;
+	len = TS_SIZE-off;
+	if ((tsp[1] & PAY_START) && buf[0] && s->len){
+		// the bytes before the pointer field end the pending section
+		l = buf[0] < len-1 ? buf[0] : len-1;
+		if ((l = section_add(s, buf+1, l, 0))){
+			if (pid == PAT_PID) parse_pat(psi, s->buf, l);
+			else parse_pmt(psi, s->buf, l);
+		}
+	}
+	if ((l = section_add(s, buf, len, tsp[1] & PAY_START))){
+		if (pid == PAT_PID) parse_pat(psi, s->buf, l);
+		else parse_pmt(psi, s->buf, l);
+	}
+	return ts_psi_done(psi);
+}
+
+int ts_psi_find(ts_psi *psi, uint8_t *buf, int len, int stride)
+{
+	int c = 0;
+
+	while ( c+stride < len){
+		if (buf[c] == 0x47 && buf[c+stride] == 0x47) break;
+		c++;
+	}
+
+	for (; c+TS_SIZE <= len; c += stride)
+		if (ts_psi_packet(psi, buf+c)) return 1;
+	return 0;
+}
+
+/* the streams of the first program with video, or of the one that 
+   contains want, with the return value of find_pids() */
+int ts_psi_pids(ts_psi *psi, uint16_t want, uint16_t *vpid, uint16_t *apid, 
+		uint16_t *ac3pid)
+{
+	int i, j;
+
+	*vpid = 0;
+	*apid = 0;
+	*ac3pid = 0;
+
+	for (i = 0; i < psi->nprog; i++){
+		ts_program *p = &psi->prog[i];
+		int found = 0;
+
+		if (!p->done || !p->vpid || !(p->apidn || p->ac3n)) continue;
+		if (want){
+			found = (p->vpid == want);
+			for (j = 0; j < p->apidn; j++)
+				if (p->apid[j] == want) found = 1;
+			for (j = 0; j < p->ac3n; j++)
+				if (p->ac3pid[j] == want) found = 1;
+			if (!found) continue;
+		}
+
+		*vpid = p->vpid;
+		found = 1;
+		if (p->apidn){
+			*apid = p->apid[0];
+			found++;
+		}
+		if (p->ac3n){
+			*ac3pid = p->ac3pid[0];
+			found++;
+		}
+		return found;
+	}
+	return 0;
+}
+
+
+// one packet with a complete section, sec needs 4 bytes for the CRC
+static int write_section(uint16_t pid, uint8_t *counter, uint8_t *sec, 
+			 int len, uint8_t *buf)
+{
+	uint32_t crc = psi_crc32(sec, len);
+	int c;
+
+	sec[len] = (uint8_t)(crc >> 24);
+	sec[len+1] = (uint8_t)(crc >> 16);
+	sec[len+2] = (uint8_t)(crc >> 8);
+	sec[len+3] = (uint8_t)crc;
+	len += 4;
+
+	c = write_ts_header(pid, counter, 1, buf, TS_SIZE-4, NULL);
+	buf[c++] = 0x00; // pointer field
+	memcpy(buf+c, sec, len);
+	c += len;
+	memset(buf+c, 0xFF, TS_SIZE-c);
+
+	return TS_SIZE;
+}
+
+static int section_head(uint8_t *sec, uint8_t table, uint16_t id)
+{
+	sec[0] = table;
+	sec[1] = 0xB0;
+	sec[2] = 0x00;
+	sec[3] = (uint8_t)(id >> 8);
+	sec[4] = (uint8_t)id;
+	sec[5] = 0xC1; // version 0, current
+	sec[6] = 0x00;
+	sec[7] = 0x00;
+	return 8;
+}
+
+static void section_length(uint8_t *sec, int len)
+{
+	len += 4 - 3; // CRC, but not the first 3 bytes
+	sec[1] = 0xB0 | ((len >> 8) & 0x0F);
+	sec[2] = (uint8_t)len;
+}
+
+static int put_pid(uint8_t *buf, uint8_t high, uint16_t pid)
+{
+	buf[0] = high | ((pid >> 8) & PID_MASK_HI);
+	buf[1] = (uint8_t)pid;
+	return 2;
+}
+
+// PAT with the one program p
+int write_pat(ts_program *p, uint8_t *counter, uint8_t *buf)
+{
+	uint8_t sec[MAX_SECTION];
+	int c;
+
+	c = section_head(sec, PAT_TABLE, 1);
+	sec[c++] = (uint8_t)(p->number >> 8);
+	sec[c++] = (uint8_t)p->number;
+	c += put_pid(sec+c, 0xE0, p->pmt_pid);
+	section_length(sec, c);
+
+	return write_section(PAT_PID, counter, sec, c, buf);
+}
+
+// PMT of p, as many streams as fit into one packet
+int write_pmt(ts_program *p, uint8_t *counter, uint8_t *buf)
+{
+	uint8_t sec[MAX_SECTION];
+	int c, i;
+	int max = TS_SIZE-4-1-4; // header, pointer field, CRC
+
+	c = section_head(sec, PMT_TABLE, p->number);
+	c += put_pid(sec+c, 0xE0, p->pcr_pid);
+	sec[c++] = 0xF0; // no program info
+	sec[c++] = 0x00;
+
+	if (p->vpid){
+		sec[c++] = 0x02;
+		c += put_pid(sec+c, 0xE0, p->vpid);
+		sec[c++] = 0xF0;
+		sec[c++] = 0x00;
+	}
+	for (i = 0; i < p->apidn && c+5 <= max; i++){
+		sec[c++] = 0x03;
+		c += put_pid(sec+c, 0xE0, p->apid[i]);
+		sec[c++] = 0xF0;
+		sec[c++] = 0x00;
+	}
+	for (i = 0; i < p->ac3n && c+8 <= max; i++){
+		sec[c++] = 0x06; // private PES with AC3 descriptor
+		c += put_pid(sec+c, 0xE0, p->ac3pid[i]);
+		sec[c++] = 0xF0;
+		sec[c++] = 0x03;
+		sec[c++] = AC3_DESC;
+		sec[c++] = 0x01;
+		sec[c++] = 0x00;
+	}
+	section_length(sec, c);
+
+	return write_section(p->pmt_pid, counter, sec, c, buf);
 }
@@ -29,10 +29,13 @@
 #define _TS_H_
 
 #define TS_SIZE        188
+#define M2TS_SIZE      192  // 4 byte timecode in front
+#define TS_RS_SIZE     204  // 16 bytes of parity at the end
 #define TRANS_ERROR    0x80
 #define PAY_START      0x40
 #define TRANS_PRIO     0x20
 #define PID_MASK_HI    0x1F
+#define N_PIDS         0x2000
 
 //flags
 #define TRANS_SCRMBL1  0x80
@@ -56,7 +59,55 @@
 #define PIECE_RATE     0x40
 #define SEAM_SPLICE    0x20
 
+// PSI
+#define PAT_PID        0x0000
+#define PAT_TABLE      0x00
+#define PMT_TABLE      0x02
+#define AC3_DESC       0x6A
+#define MAX_SECTION    1024
+#define MAX_PROGRAMS   32
+#define MAX_PSTREAMS   16
+
+typedef struct ts_section_s {
+	int len;
+	uint8_t buf[MAX_SECTION];
+} ts_section;
+
+typedef struct ts_program_s {
+	uint16_t number;
+	uint16_t pmt_pid;
+	uint16_t pcr_pid;
+	uint16_t vpid;
+	int apidn;
+	uint16_t apid[MAX_PSTREAMS];
+	int ac3n;
+	uint16_t ac3pid[MAX_PSTREAMS];
+	int done;
+	ts_section sec;
+} ts_program;
+
+// programs of a TS as given by the PAT and the PMTs
+typedef struct ts_psi_s {
+	int nprog;
+	ts_program prog[MAX_PROGRAMS];
+	int pat_last;
+	uint8_t pat_seen[32];
+	int pat_done;
+	ts_section pat;
+} ts_psi;
+
 uint16_t get_pid(uint8_t *pid);
-int find_pids(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf, int len);
-int find_pids_pos(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf, int len, int *vpos, int *apos, int *ac3pos);
+int write_ts_header(uint16_t pid, uint8_t *counter, int pes_start, 
+		    uint8_t *buf, uint8_t length, uint64_t *pcr);
+int write_pat(ts_program *p, uint8_t *counter, uint8_t *buf);
+int write_pmt(ts_program *p, uint8_t *counter, uint8_t *buf);
+int ts_stride(uint8_t *buf, int len, int *start);
+void ts_psi_init(ts_psi *psi);
+int ts_psi_done(ts_psi *psi);
+int ts_psi_packet(ts_psi *psi, uint8_t *tsp);
+int ts_psi_find(ts_psi *psi, uint8_t *buf, int len, int stride);
+int ts_psi_pids(ts_psi *psi, uint16_t want, uint16_t *vpid, uint16_t *apid, 
+		uint16_t *ac3pid);
+int find_pids(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf, int len, int stride);
+int find_pids_pos(uint16_t *vpid, uint16_t *apid, uint16_t *ac3pid,uint8_t *buf, int len, int stride, int *vpos, int *apos, int *ac3pos);
 #endif /*_TS_H_*/